@@ -4,14 +4,18 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "dudect/perf.h"
 #include "report.h"
 #include "web.h"
 
@@ -20,6 +24,16 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Commands and parameters are also entered into open-addressing hash tables,
+ * so that dispatch by name does not need to walk the lists.
+ */
+#define HASH_SIZE 256 /* Must be a power of 2 */
+#define HASH_LIMIT (HASH_SIZE * 3 / 4)
+static cmd_element_t *cmd_table[HASH_SIZE];
+static param_element_t *param_table[HASH_SIZE];
+static int cmd_cnt = 0;
+static int param_cnt = 0;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -33,12 +47,19 @@ static double first_time, last_time;
  * Must create stack of buffers to handle I/O with nested source commands.
  */
 
+/* Size of each refill, and of the longest line that can be read.
+ * Can be overridden at build time, e.g. -DRIO_BUFSIZE=65536
+ */
+#ifndef RIO_BUFSIZE
 #define RIO_BUFSIZE 8192
+#endif
 
 typedef struct __rio {
     int fd;                /* File descriptor */
-    int count;             /* Unread bytes in internal buffer */
+    ssize_t count;         /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
+    char *map;             /* Whole file when memory-mapped, else NULL */
+    size_t map_size;       /* Length of mapping */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
     struct __rio *prev;    /* Next element in stack */
 } rio_t;
@@ -49,6 +70,28 @@ static char linebuf[RIO_BUFSIZE];
 /* Maximum file descriptor */
 static int fd_max = 0;
 
+/* Per-command latency histograms, log-linear like HdrHistogram: values below
+ * 2^PROFILE_SUB_BITS ns are exact, larger ones fall in one of
+ * 2^PROFILE_SUB_BITS buckets per power of two (about 6% resolution).
+ */
+#define PROFILE_SUB_BITS 4
+#define PROFILE_BUCKETS ((64 - PROFILE_SUB_BITS + 1) << PROFILE_SUB_BITS)
+
+typedef struct __cmd_profile {
+    uint64_t count;
+    uint64_t min, max, total; /* In nanoseconds */
+    uint64_t bucket[PROFILE_BUCKETS];
+} cmd_profile_t;
+
+static int profile = 0;
+
+/* Structured output */
+static json_helper_t json_helper = NULL;
+static const char *trace_name = "stdin";
+static uint64_t trace_start_ns;
+static size_t trace_cmd_cnt = 0;
+static bool trace_recorded = false;
+
 /* Parameters */
 static int err_limit = 5;
 static int err_cnt = 0;
@@ -72,6 +115,36 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a hash of a name */
+static unsigned int hash_name(const char *name)
+{
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Return the table slot holding name, or the empty slot where it belongs */
+static cmd_element_t **find_cmd_slot(const char *name)
+{
+    unsigned int i = hash_name(name);
+    while (cmd_table[i & (HASH_SIZE - 1)] &&
+           strcmp(cmd_table[i & (HASH_SIZE - 1)]->name, name))
+        i++;
+    return &cmd_table[i & (HASH_SIZE - 1)];
+}
+
+static param_element_t **find_param_slot(const char *name)
+{
+    unsigned int i = hash_name(name);
+    while (param_table[i & (HASH_SIZE - 1)] &&
+           strcmp(param_table[i & (HASH_SIZE - 1)]->name, name))
+        i++;
+    return &param_table[i & (HASH_SIZE - 1)];
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -87,8 +160,14 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->profile = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
+
+    cmd_element_t **slot = find_cmd_slot(name);
+    if (!*slot && ++cmd_cnt > HASH_LIMIT)
+        report_event(MSG_FATAL, "Exceeded limit on commands");
+    *slot = cmd;
 }
 
 /* Add a new parameter */
@@ -109,9 +188,37 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+
+    param_element_t **slot = find_param_slot(name);
+    if (!*slot && ++param_cnt > HASH_LIMIT)
+        report_event(MSG_FATAL, "Exceeded limit on parameters");
+    *slot = param;
 }
 
-/* Parse a string into a command line */
+/* Arena reused by parse_args for every command line: the words are copied
+ * into arg_buf, each null-terminated, and arg_vec points at them.  Both only
+ * grow, so typical lines cause no heap traffic once warmed up.
+ */
+static char *arg_buf = NULL;
+static size_t arg_buf_size = 0;
+static char **arg_vec = NULL;
+static int arg_vec_cnt = 0;
+
+static void free_args()
+{
+    if (arg_buf)
+        free_block(arg_buf, arg_buf_size);
+    if (arg_vec)
+        free_array(arg_vec, arg_vec_cnt, sizeof(char *));
+    arg_buf = NULL;
+    arg_buf_size = 0;
+    arg_vec = NULL;
+    arg_vec_cnt = 0;
+}
+
+/* Parse a string into a command line.
+ * The returned array and its strings stay valid until the next call.
+ */
 static char **parse_args(char *line, int *argcp)
 {
     /* Must first determine how many arguments there are.
@@ -120,11 +227,16 @@ static char **parse_args(char *line, int *argcp)
     size_t len = strlen(line);
 
     /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+    if (len + 1 > arg_buf_size) {
+        size_t size = len + 1 > RIO_BUFSIZE ? len + 1 : RIO_BUFSIZE;
+        if (arg_buf)
+            free_block(arg_buf, arg_buf_size);
+        arg_buf = malloc_or_fail(size, "parse_args");
+        arg_buf_size = size;
+    }
 
     char *src = line;
-    char *dst = buf;
+    char *dst = arg_buf;
     bool skipping = true;
     int c;
     int argc = 0;
@@ -144,18 +256,26 @@ static char **parse_args(char *line, int *argcp)
             *dst++ = c;
         }
     }
-
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
+    *dst = '\0';
+
+    /* Now point argv at each string */
+    if (argc > arg_vec_cnt) {
+        int cnt = arg_vec_cnt ? arg_vec_cnt : 16;
+        while (cnt < argc)
+            cnt *= 2;
+        if (arg_vec)
+            free_array(arg_vec, arg_vec_cnt, sizeof(char *));
+        arg_vec = calloc_or_fail(cnt, sizeof(char *), "parse_args");
+        arg_vec_cnt = cnt;
+    }
+    src = arg_buf;
     for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+        arg_vec[i] = src;
+        src += strlen(src) + 1;
     }
 
-    free_block(buf, len + 1);
     *argcp = argc;
-    return argv;
+    return arg_vec;
 }
 
 static void record_error()
@@ -167,18 +287,142 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+static int profile_bucket(uint64_t ns)
+{
+    if (ns < (1 << PROFILE_SUB_BITS))
+        return ns;
+    int shift = 63 - __builtin_clzll(ns) - PROFILE_SUB_BITS;
+    return ((shift + 1) << PROFILE_SUB_BITS) +
+           ((ns >> shift) & ((1 << PROFILE_SUB_BITS) - 1));
+}
+
+/* Largest value falling in bucket */
+static uint64_t profile_bucket_value(int b)
+{
+    if (b < (1 << PROFILE_SUB_BITS))
+        return b;
+    int shift = (b >> PROFILE_SUB_BITS) - 1;
+    uint64_t low = (uint64_t) ((1 << PROFILE_SUB_BITS) +
+                               (b & ((1 << PROFILE_SUB_BITS) - 1)))
+                   << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+static void profile_record(cmd_element_t *cmd, uint64_t ns)
+{
+    cmd_profile_t *prof = cmd->profile;
+    if (!prof) {
+        prof = cmd->profile =
+            calloc_or_fail(1, sizeof(cmd_profile_t), "profile_record");
+        prof->min = UINT64_MAX;
+    }
+    prof->count++;
+    prof->total += ns;
+    if (ns < prof->min)
+        prof->min = ns;
+    if (ns > prof->max)
+        prof->max = ns;
+    prof->bucket[profile_bucket(ns)]++;
+}
+
+/* Latency below which the given fraction of samples falls */
+static uint64_t profile_percentile(const cmd_profile_t *prof, double frac)
+{
+    uint64_t rank = (uint64_t) (frac * prof->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        seen += prof->bucket[b];
+        if (seen >= rank) {
+            uint64_t v = profile_bucket_value(b);
+            return v < prof->max ? v : prof->max;
+        }
+    }
+    return prof->max;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Append s to the string of length n in buf, but only if all of it fits
+ * within size bytes.  Return the new length.
+ */
+static size_t json_append(char *buf, size_t size, size_t n, const char *s)
+{
+    size_t len = strlen(s);
+    if (n + len < size) {
+        memcpy(buf + n, s, len + 1);
+        n += len;
+    }
+    return n;
+}
+
+/* Write structured record describing one command */
+static void json_cmd_record(int argc, char *argv[], bool ok, uint64_t ns)
+{
+    char buf[1024];
+    /* Every append stays within limit, which keeps one byte for the "]" */
+    const size_t limit = sizeof(buf) - 1;
+    const char *args = ", \"args\": [";
+    size_t n = json_append(buf, limit, 0, "\"op\": ");
+    n += json_string(buf + n, limit - n - strlen(args), argv[0]);
+    n = json_append(buf, limit, n, args);
+    for (int i = 1; i < argc; i++) {
+        const char *sep = i > 1 ? ", " : "";
+        /* Arguments that do not fit are truncated, then left out */
+        if (n + strlen(sep) + 3 >= limit)
+            break;
+        n = json_append(buf, limit, n, sep);
+        n += json_string(buf + n, limit - n, argv[i]);
+    }
+    buf[n++] = ']';
+    buf[n] = '\0';
+
+    char extra[256] = "";
+    if (json_helper)
+        json_helper(extra, sizeof(extra));
+    report_json("%s, \"ok\": %s, \"elapsed_ns\": %lu%s", buf,
+                ok ? "true" : "false", (unsigned long) ns, extra);
+}
+
+/* Write structured record summarizing the whole run */
+static void json_trace_record()
+{
+    if (!json_enabled() || trace_recorded)
+        return;
+    trace_recorded = true;
+
+    char extra[256] = "";
+    if (json_helper)
+        json_helper(extra, sizeof(extra));
+    report_json("\"commands\": %lu, \"errors\": %d, \"elapsed_ns\": %lu%s",
+                (unsigned long) trace_cmd_cnt, err_cnt,
+                (unsigned long) (now_ns() - trace_start_ns), extra);
+}
+
+/* Execute a command, already looked up, with its arguments */
+static bool dispatch_cmd(cmd_element_t *next_cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+        trace_cmd_cnt++;
+        if (profile || json_enabled()) {
+            uint64_t start = now_ns();
+            ok = next_cmd->operation(argc, argv);
+            uint64_t ns = now_ns() - start;
+            /* After quit, the command element and arguments are gone */
+            if (profile && !quit_flag)
+                profile_record(next_cmd, ns);
+            if (json_enabled() && !quit_flag)
+                json_cmd_record(argc, argv, ok, ns);
+        } else {
+            ok = next_cmd->operation(argc, argv);
+        }
         if (!ok)
             record_error();
     } else {
@@ -190,6 +434,15 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    /* Try to find matching command */
+    return dispatch_cmd(*find_cmd_slot(argv[0]), argc, argv);
+}
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
@@ -198,12 +451,7 @@ static bool interpret_cmd(char *cmdline)
 
     int argc;
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
-
-    return ok;
+    return interpret_cmda(argc, argv);
 }
 
 /* Set function to be executed as part of program exit */
@@ -221,14 +469,24 @@ void set_echo(bool on)
     echo = on ? 1 : 0;
 }
 
+void set_json_helper(json_helper_t jf)
+{
+    json_helper = jf;
+}
+
 /* Built-in commands */
 static bool do_quit(int argc, char *argv[])
 {
+    /* Describe the run while the program state is still intact */
+    json_trace_record();
+
     cmd_element_t *c = cmd_list;
     bool ok = true;
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        if (ele->profile)
+            free_block(ele->profile, sizeof(cmd_profile_t));
         free_block(ele, sizeof(cmd_element_t));
     }
 
@@ -238,6 +496,11 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    cmd_list = NULL;
+    param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    cmd_cnt = param_cnt = 0;
 
     while (buf_stack)
         pop_file();
@@ -246,6 +509,9 @@ static bool do_quit(int argc, char *argv[])
         ok = ok && quit_helpers[i](argc, argv);
     }
 
+    /* argv may live in the argument arena, so release it last */
+    free_args();
+
     quit_flag = true;
     return ok;
 }
@@ -320,17 +586,14 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        /* Find parameter in table */
+        param_element_t *plist = *find_param_slot(name);
+        if (plist) {
+            int oldval = *plist->valp;
+            *plist->valp = value;
+            if (plist->setter)
+                plist->setter(oldval);
+            found = true;
         }
         /* Didn't find parameter */
         if (!found) {
@@ -379,18 +642,59 @@ static bool do_time(int argc, char *argv[])
         double elapsed = last_time - first_time;
         report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
     } else {
+        int64_t before[N_COUNTERS], after[N_COUNTERS];
+        bool perf = counters_open() && counters_read(before);
         ok = interpret_cmda(argc - 1, argv + 1);
         if (block_flag) {
             block_timing = true;
         } else {
             delta = delta_time(&last_time);
             report(1, "Delta time = %.3f", delta);
+            if (perf && counters_read(after)) {
+                for (int i = 0; i < N_COUNTERS; i++) {
+                    if (counters_supported(i))
+                        report(1, "  %s = %lld", counter_names[i],
+                               (long long) (after[i] - before[i]));
+                }
+            }
         }
     }
 
     return ok;
 }
 
+static bool do_profile(int argc, char *argv[])
+{
+    bool reset = argc == 2 && !strcmp(argv[1], "reset");
+    if (argc > 2 || (argc == 2 && !reset)) {
+        report(1, "%s takes no arguments or 'reset'", argv[0]);
+        return false;
+    }
+
+    if (!reset) {
+        if (!profile)
+            report(1, "Profiling is off. Use 'option profile 1' to enable");
+        report(1, "%-12s%10s%12s%12s%12s%12s%14s", "Command", "count",
+               "min(ns)", "p50(ns)", "p99(ns)", "max(ns)", "total(ms)");
+    }
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        cmd_profile_t *prof = c->profile;
+        if (!prof)
+            continue;
+        if (reset) {
+            free_block(prof, sizeof(cmd_profile_t));
+            c->profile = NULL;
+            continue;
+        }
+        report(1, "%-12s%10lu%12lu%12lu%12lu%12lu%14.3f", c->name,
+               (unsigned long) prof->count, (unsigned long) prof->min,
+               (unsigned long) profile_percentile(prof, 0.5),
+               (unsigned long) profile_percentile(prof, 0.99),
+               (unsigned long) prof->max, prof->total / 1e6);
+    }
+    return true;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -418,8 +722,12 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    cmd_cnt = param_cnt = 0;
     err_cnt = 0;
     quit_flag = false;
+    set_json_trace(trace_name);
 
     ADD_COMMAND(help, "Show summary", "");
     ADD_COMMAND(option,
@@ -430,16 +738,20 @@ void init_cmd()
     ADD_COMMAND(log, "Copy output to file", "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(profile, "Show or reset per-command latency statistics",
+                "[reset]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("profile", &profile, "Record per-command latency", NULL);
 
     init_in();
     init_time(&last_time);
     first_time = last_time;
+    trace_start_ns = now_ns();
 }
 
 /* Create new buffer for named file.
@@ -460,9 +772,26 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->count = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_size = 0;
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
+    /* Map regular files as a whole, so lines are taken straight from the
+     * page cache rather than through read() into the buffer.
+     */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_size = st.st_size;
+            rnew->bufptr = map;
+            rnew->count = st.st_size;
+        }
+    }
+
     return true;
 }
 
@@ -472,6 +801,8 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_size);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -488,21 +819,26 @@ static void init_in()
  */
 static char *readline()
 {
-    char c;
     char *lptr = linebuf;
+    /* Leave room for artificial newline and null terminator */
+    int room = RIO_BUFSIZE - 2;
+    bool eol = false;
 
     if (!buf_stack)
         return NULL;
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
+    while (room > 0 && !eol) {
         if (buf_stack->count <= 0) {
-            /* Need to read from input file */
-            buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
+            /* Need to read from input file, unless it is mapped as a whole */
+            buf_stack->count =
+                buf_stack->map
+                    ? 0
+                    : read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
             buf_stack->bufptr = buf_stack->buf;
             if (buf_stack->count <= 0) {
                 /* Encountered EOF */
                 pop_file();
-                if (cnt > 0) {
+                if (lptr > linebuf) {
                     /* Last line of file did not terminate with newline. */
                     /*  Terminate line & return it */
                     *lptr++ = '\n';
@@ -517,15 +853,21 @@ static char *readline()
             }
         }
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
-            break;
+        /* Have text in buffer.  Copy up to and including newline at once */
+        int cnt = buf_stack->count < room ? (int) buf_stack->count : room;
+        char *nl = memchr(buf_stack->bufptr, '\n', cnt);
+        if (nl) {
+            cnt = nl - buf_stack->bufptr + 1;
+            eol = true;
+        }
+        memcpy(lptr, buf_stack->bufptr, cnt);
+        lptr += cnt;
+        buf_stack->bufptr += cnt;
+        buf_stack->count -= cnt;
+        room -= cnt;
     }
 
-    if (c != '\n') {
+    if (!eol) {
         /* Hit buffer limit.  Artificially terminate line */
         *lptr++ = '\n';
     }
@@ -630,6 +972,7 @@ static int cmd_select(int nfds,
 
 bool finish_cmd()
 {
+    json_trace_record();
     bool ok = true;
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
@@ -680,6 +1023,10 @@ void completion(const char *buf, line_completions_t *lc)
 
 bool run_console(char *infile_name)
 {
+    if (infile_name) {
+        trace_name = infile_name;
+        set_json_trace(trace_name);
+    }
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
@@ -707,3 +1054,235 @@ bool run_console(char *infile_name)
 
     return err_cnt == 0;
 }
+
+/* Compiled traces
+ *
+ * A trace file can be compiled into a binary form that is replayed without
+ * reading, tokenizing or looking up commands by name.  All words are interned
+ * in a string table; each command becomes its word count followed by the
+ * string-table index of every word, the first being the command name.
+ * Layout, in native byte order:
+ *
+ *   header    uint32_t[4]: magic, string count, code words, string bytes
+ *   code      uint32_t[code words]
+ *   offsets   uint32_t[string count], start of each string
+ *   strings   null-terminated strings
+ *
+ * Command names are resolved to handlers once, when the trace is loaded.
+ */
+
+#define TRACE_MAGIC 0x31425451 /* "QTB1" */
+
+/* Growable array, accounted for like every other console allocation */
+typedef struct {
+    void *data;
+    size_t cnt; /* Elements in use */
+    size_t cap; /* Elements allocated */
+    size_t elsize;
+} vec_t;
+
+/* Append n elements to vector and return pointer to the first of them */
+static void *vec_push(vec_t *v, size_t n)
+{
+    if (v->cnt + n > v->cap) {
+        size_t cap = v->cap ? v->cap : 256;
+        while (cap < v->cnt + n)
+            cap *= 2;
+        void *data = calloc_or_fail(cap, v->elsize, "vec_push");
+        if (v->data) {
+            memcpy(data, v->data, v->cnt * v->elsize);
+            free_array(v->data, v->cap, v->elsize);
+        }
+        v->data = data;
+        v->cap = cap;
+    }
+    void *p = (char *) v->data + v->cnt * v->elsize;
+    v->cnt += n;
+    return p;
+}
+
+static void vec_release(vec_t *v)
+{
+    if (v->data)
+        free_array(v->data, v->cap, v->elsize);
+    v->data = NULL;
+    v->cnt = v->cap = 0;
+}
+
+typedef struct {
+    vec_t code;    /* uint32_t */
+    vec_t offsets; /* uint32_t */
+    vec_t strings; /* char */
+    vec_t index;   /* uint32_t, hash table of string index + 1, 0 = empty */
+} trace_builder_t;
+
+static const char *builder_word(trace_builder_t *tb, uint32_t i)
+{
+    return (char *) tb->strings.data + ((uint32_t *) tb->offsets.data)[i];
+}
+
+/* Return the hash table slot holding word, or the empty slot for it */
+static uint32_t *builder_slot(trace_builder_t *tb, const char *word)
+{
+    uint32_t *slots = tb->index.data;
+    size_t mask = tb->index.cnt - 1;
+    unsigned int h = hash_name(word);
+    while (slots[h & mask] && strcmp(builder_word(tb, slots[h & mask] - 1), word))
+        h++;
+    return &slots[h & mask];
+}
+
+/* Return string-table index of word, adding it if not yet present */
+static uint32_t intern_word(trace_builder_t *tb, const char *word)
+{
+    /* Keep hash table at most half full */
+    if ((tb->offsets.cnt + 1) * 2 > tb->index.cnt) {
+        size_t cnt = tb->index.cnt ? tb->index.cnt * 2 : 256;
+        vec_release(&tb->index);
+        vec_push(&tb->index, cnt);
+        for (uint32_t i = 0; i < tb->offsets.cnt; i++)
+            *builder_slot(tb, builder_word(tb, i)) = i + 1;
+    }
+
+    uint32_t *slot = builder_slot(tb, word);
+    if (*slot)
+        return *slot - 1;
+
+    size_t len = strlen(word) + 1;
+    uint32_t i = tb->offsets.cnt;
+    *(uint32_t *) vec_push(&tb->offsets, 1) = tb->strings.cnt;
+    memcpy(vec_push(&tb->strings, len), word, len);
+    *slot = i + 1;
+    return i;
+}
+
+/* Compile trace file into binary form for fast replay */
+bool compile_trace(const char *infile_name, const char *outfile_name)
+{
+    FILE *in = fopen(infile_name, "r");
+    if (!in) {
+        report(1, "Could not open source file '%s'", infile_name);
+        return false;
+    }
+
+    trace_builder_t tb = {
+        .code = {.elsize = sizeof(uint32_t)},
+        .offsets = {.elsize = sizeof(uint32_t)},
+        .strings = {.elsize = sizeof(char)},
+        .index = {.elsize = sizeof(uint32_t)},
+    };
+    size_t cmd_cnt = 0;
+    while (fgets(linebuf, RIO_BUFSIZE - 1, in)) {
+        int argc;
+        char **argv = parse_args(linebuf, &argc);
+        if (argc == 0)
+            continue;
+        *(uint32_t *) vec_push(&tb.code, 1) = argc;
+        for (int i = 0; i < argc; i++) {
+            uint32_t idx = intern_word(&tb, argv[i]);
+            *(uint32_t *) vec_push(&tb.code, 1) = idx;
+        }
+        cmd_cnt++;
+    }
+    fclose(in);
+
+    bool ok = false;
+    FILE *out = fopen(outfile_name, "wb");
+    if (out) {
+        uint32_t header[4] = {TRACE_MAGIC, tb.offsets.cnt, tb.code.cnt,
+                              tb.strings.cnt};
+        ok = fwrite(header, sizeof(header), 1, out) == 1 &&
+             fwrite(tb.code.data, sizeof(uint32_t), tb.code.cnt, out) ==
+                 tb.code.cnt &&
+             fwrite(tb.offsets.data, sizeof(uint32_t), tb.offsets.cnt, out) ==
+                 tb.offsets.cnt &&
+             fwrite(tb.strings.data, 1, tb.strings.cnt, out) ==
+                 tb.strings.cnt;
+        ok = !fclose(out) && ok;
+    }
+    if (ok)
+        report(1, "Compiled %zu commands, %zu distinct words, into '%s'",
+               cmd_cnt, tb.offsets.cnt, outfile_name);
+    else
+        report(1, "Could not write compiled trace '%s'", outfile_name);
+
+    vec_release(&tb.code);
+    vec_release(&tb.offsets);
+    vec_release(&tb.strings);
+    vec_release(&tb.index);
+    return ok;
+}
+
+/* Run commands from compiled trace file */
+bool replay_trace(const char *file_name)
+{
+    trace_name = file_name;
+    set_json_trace(trace_name);
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        report(1, "ERROR: Could not open compiled trace '%s'", file_name);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    uint32_t *words = malloc_or_fail(size + 1, "replay_trace");
+    bool ok = read(fd, words, size) == (ssize_t) size;
+    close(fd);
+
+    /* Validate layout before trusting any index */
+    uint32_t str_cnt = 0, code_cnt = 0, str_bytes = 0;
+    if (ok && size >= 4 * sizeof(uint32_t) && words[0] == TRACE_MAGIC) {
+        str_cnt = words[1];
+        code_cnt = words[2];
+        str_bytes = words[3];
+        ok = size == (4 + (size_t) code_cnt + str_cnt) * sizeof(uint32_t) +
+                         str_bytes;
+    } else {
+        ok = false;
+    }
+    uint32_t *code = words + 4;
+    uint32_t *offsets = code + code_cnt;
+    char *strings = (char *) (offsets + str_cnt);
+    if (ok)
+        strings[str_bytes] = '\0';
+    for (uint32_t i = 0; ok && i < str_cnt; i++)
+        ok = offsets[i] < str_bytes;
+    for (uint32_t pc = 0; ok && pc < code_cnt; pc += code[pc] + 1) {
+        ok = code[pc] > 0 && code[pc] < code_cnt - pc;
+        for (uint32_t i = 1; ok && i <= code[pc]; i++)
+            ok = code[pc + i] < str_cnt;
+    }
+    if (!ok) {
+        report(1, "ERROR: '%s' is not a valid compiled trace", file_name);
+        free_block(words, size + 1);
+        return false;
+    }
+
+    /* Turn each index into the string itself, and resolve each command */
+    char **argvs = calloc_or_fail(code_cnt, sizeof(char *), "replay_trace");
+    cmd_element_t **cmds =
+        calloc_or_fail(code_cnt, sizeof(cmd_element_t *), "replay_trace");
+    for (uint32_t pc = 0; pc < code_cnt; pc += code[pc] + 1) {
+        for (uint32_t i = 1; i <= code[pc]; i++)
+            argvs[pc + i] = strings + offsets[code[pc + i]];
+        cmds[pc] = *find_cmd_slot(argvs[pc + 1]);
+    }
+
+    /* As for commands read from a file by cmd_select */
+    set_echo(0);
+    for (uint32_t pc = 0; pc < code_cnt && !quit_flag; pc += code[pc] + 1) {
+        dispatch_cmd(cmds[pc], code[pc], &argvs[pc + 1]);
+
+        /* Run any file pushed by 'source' */
+        while (!cmd_done())
+            cmd_select(0, NULL, NULL, NULL, NULL);
+    }
+
+    free_array(cmds, code_cnt, sizeof(cmd_element_t *));
+    free_array(argvs, code_cnt, sizeof(char *));
+    free_block(words, size + 1);
+    return err_cnt == 0;
+}
@@ -24,6 +24,8 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    /* Latency statistics, allocated once the command runs while profiling */
+    struct __cmd_profile *profile;
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -56,6 +58,12 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* Optionally supply function that describes program state in structured
+ * output records.  It writes members, each preceded by a comma, into buf
+ */
+typedef void (*json_helper_t)(char *buf, size_t size);
+void set_json_helper(json_helper_t jf);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
@@ -68,6 +76,16 @@ bool finish_cmd();
  */
 bool run_console(char *infile_name);
 
+/* Compile commands in infile_name into binary form, written to outfile_name.
+ * Return true if successful
+ */
+bool compile_trace(const char *infile_name, const char *outfile_name);
+
+/* Run commands from file produced by compile_trace.
+ * Return true if no errors occurred
+ */
+bool replay_trace(const char *file_name);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, line_completions_t *lc);
 
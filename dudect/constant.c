@@ -1,9 +1,12 @@
 #include <assert.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "../report.h"
 #include "constant.h"
 #include "cpucycles.h"
+#include "perf.h"
 #include "queue.h"
 #include "random.h"
 
@@ -14,12 +17,6 @@ static struct list_head *l = NULL;
 
 #define dut_new() ((void) (l = q_new()))
 
-#define dut_size(n)                                \
-    do {                                           \
-        for (int __iter = 0; __iter < n; ++__iter) \
-            q_size(l);                             \
-    } while (0)
-
 #define dut_insert_head(s, n)    \
     do {                         \
         int j = n;               \
@@ -36,13 +33,50 @@ static struct list_head *l = NULL;
 
 #define dut_free() ((void) (q_free(l)))
 
+/* Samples build queues of up to DUT_MAX_SIZE elements.  Building a long
+ * queue leaves caches and branch predictors in a state that slows down
+ * whatever runs next, so a ballast queue makes up the difference: every
+ * sample allocates the same number of elements, whatever its class, and
+ * the queue under test differs only in its length.
+ */
+#define DUT_MAX_SIZE 10000
+static struct list_head *ballast = NULL;
+
 static char random_string[N_MEASURES][8];
 static int random_string_iter = 0;
 
+/* Off by default: a pooled queue stays in cache for one class but not the
+ * other, which changes what each sample measures
+ */
+int dudect_pool = 0;
+
+/* Queues kept between samples when dudect_pool is set.  A sample takes the
+ * one whose size is closest to the size it needs, so that the zero-sized
+ * class and the random-sized class each settle on a queue of their own.
+ */
+#define POOL_QUEUES 2
+static struct list_head *pool[POOL_QUEUES];
+static int pool_size[POOL_QUEUES];
+static int pool_cur;
+/* Whether l, the queue of the sample in progress, belongs to the pool */
+static bool dut_pooled;
+
+void free_dut(void)
+{
+    for (int i = 0; i < POOL_QUEUES; i++) {
+        q_free(pool[i]);
+        pool[i] = NULL;
+        pool_size[i] = 0;
+    }
+    q_free(ballast);
+    ballast = NULL;
+    l = NULL;
+}
+
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
 {
-    l = NULL;
+    free_dut();
 }
 
 static char *get_random_string(void)
@@ -51,6 +85,73 @@ static char *get_random_string(void)
     return random_string[random_string_iter];
 }
 
+/* Touch both ends of l, where the O(1) operations work, so that they are
+ * as warm at the end of a long queue as at the end of a short one
+ */
+static void dut_warm(void)
+{
+    volatile char sink = 0;
+    struct list_head *ends[] = {l->next, l->prev};
+    for (int i = 0; i < 2; i++) {
+        if (ends[i] == l)
+            continue;
+        element_t *e = list_entry(ends[i], element_t, list);
+        sink ^= e->value[0];
+        sink ^= (char) (uintptr_t) ends[i]->prev->next;
+        sink ^= (char) (uintptr_t) ends[i]->next->prev;
+    }
+}
+
+/* Point l at a queue of n elements and return its actual size */
+static int dut_acquire(int n)
+{
+    dut_pooled = dudect_pool;
+    if (!dudect_pool) {
+        ballast = q_new();
+        for (int i = n; i <= DUT_MAX_SIZE; i++)
+            q_insert_head(ballast, get_random_string());
+        dut_new();
+        dut_insert_head(get_random_string(), n);
+        dut_warm();
+        return n;
+    }
+
+    pool_cur = 0;
+    for (int i = 1; i < POOL_QUEUES; i++) {
+        if (abs(pool_size[i] - n) < abs(pool_size[pool_cur] - n))
+            pool_cur = i;
+    }
+    if (!pool[pool_cur]) {
+        pool[pool_cur] = q_new();
+        pool_size[pool_cur] = 0;
+    }
+    l = pool[pool_cur];
+
+    int *size = &pool_size[pool_cur];
+    while (*size < n && q_insert_head(l, get_random_string()))
+        (*size)++;
+    while (*size > n) {
+        element_t *e = q_remove_head(l, NULL, 0);
+        if (!e)
+            break;
+        q_release_element(e);
+        (*size)--;
+    }
+    return *size;
+}
+
+/* Hand back the queue of the sample, which now holds size elements */
+static void dut_release(int size)
+{
+    if (dut_pooled) {
+        pool_size[pool_cur] = size;
+    } else {
+        dut_free();
+        q_free(ballast);
+        ballast = NULL;
+    }
+}
+
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
     randombytes(input_data, N_MEASURES * CHUNK_SIZE);
@@ -67,96 +168,208 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
     }
 }
 
-bool measure(int64_t *before_ticks,
-             int64_t *after_ticks,
-             uint8_t *input_data,
-             int mode)
+int dudect_counter = COUNTER_CYCLES;
+
+/* State shared by the callbacks of the sample in progress */
+static char *dut_str;
+static element_t *dut_elem;
+static int dut_before, dut_result;
+static bool dut_ok;
+
+/* Inserting into an empty queue links the new node to the head alone, so
+ * inserts, like removes, start from at least one element
+ */
+static void setup_insert(int n)
 {
-    assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
-
-    switch (mode) {
-    case DUT(insert_head):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
-                return false;
-        }
-        break;
-    case DUT(insert_tail):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
-                return false;
-        }
-        break;
-    case DUT(remove_head):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
-                return false;
-        }
-        break;
-    case DUT(remove_tail):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
-                return false;
-        }
-        break;
-    default:
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
+    dut_str = get_random_string();
+    dut_before = dut_acquire(n + 1);
+}
+
+static void setup_remove(int n)
+{
+    dut_before = dut_acquire(n + 1);
+    dut_elem = NULL;
+}
+
+/* Length of the queue given to size, delete_mid and swap.  Under this list
+ * API they must walk the list, so both classes get the same length and
+ * differ only in the strings stored: class 0 repeats one string, class 1
+ * holds random ones.  These rows check that the time does not depend on
+ * the data.
+ */
+#define DATA_QUEUE_SIZE 64
+
+static void setup_data(int n)
+{
+    dut_pooled = false;
+    dut_new();
+    for (int i = 0; i < DATA_QUEUE_SIZE; i++)
+        q_insert_head(l, n ? get_random_string() : random_string[0]);
+    dut_before = DATA_QUEUE_SIZE;
+}
+
+static void measure_insert_head(void)
+{
+    q_insert_head(l, dut_str);
+}
+
+static void measure_insert_tail(void)
+{
+    q_insert_tail(l, dut_str);
+}
+
+static void measure_remove_head(void)
+{
+    dut_elem = q_remove_head(l, NULL, 0);
+}
+
+static void measure_remove_tail(void)
+{
+    dut_elem = q_remove_tail(l, NULL, 0);
+}
+
+static void measure_size(void)
+{
+    dut_result = q_size(l);
+}
+
+static void measure_delete_mid(void)
+{
+    dut_ok = q_delete_mid(l);
+}
+
+static void measure_swap(void)
+{
+    q_swap(l);
+}
+
+static bool teardown_insert(void)
+{
+    int after_size = q_size(l);
+    dut_release(after_size);
+    return dut_before == after_size - 1;
+}
+
+static bool teardown_remove(void)
+{
+    int after_size = q_size(l);
+    if (dut_elem)
+        q_release_element(dut_elem);
+    dut_release(after_size);
+    return dut_before == after_size + 1;
+}
+
+static bool teardown_size(void)
+{
+    dut_release(dut_before);
+    return dut_result == dut_before;
+}
+
+static bool teardown_delete_mid(void)
+{
+    int after_size = q_size(l);
+    dut_release(after_size);
+    return dut_ok && dut_before == after_size + 1;
+}
+
+static bool teardown_swap(void)
+{
+    int after_size = q_size(l);
+    dut_release(after_size);
+    return dut_before == after_size;
+}
+
+static const dut_op_t dut_ops[DUT_COUNT] = {
+    [DUT(insert_head)] = {"insert_head", setup_insert, measure_insert_head,
+                          teardown_insert},
+    [DUT(insert_tail)] = {"insert_tail", setup_insert, measure_insert_tail,
+                          teardown_insert},
+    [DUT(remove_head)] = {"remove_head", setup_remove, measure_remove_head,
+                          teardown_remove},
+    [DUT(remove_tail)] = {"remove_tail", setup_remove, measure_remove_tail,
+                          teardown_remove},
+    [DUT(size)] = {"size", setup_data, measure_size, teardown_size},
+    [DUT(delete_mid)] = {"delete_mid", setup_data, measure_delete_mid,
+                         teardown_delete_mid},
+    [DUT(swap)] = {"swap", setup_data, measure_swap, teardown_swap},
+};
+
+int dut_lookup(const char *name)
+{
+    for (int mode = 0; mode < DUT_COUNT; mode++) {
+        if (dut_ops[mode].name && !strcmp(dut_ops[mode].name, name))
+            return mode;
+    }
+    return -1;
+}
+
+const char *dut_name(int mode)
+{
+    return mode >= 0 && mode < DUT_COUNT ? dut_ops[mode].name : NULL;
+}
+
+enum { MEASURE_WRONG, MEASURE_OK, MEASURE_STOPPED };
+
+/* Take one batch of samples, reading counter if it is not negative and
+ * cpucycles() otherwise
+ */
+static int measure_batch(int64_t *before_ticks,
+                         int64_t *after_ticks,
+                         uint8_t *input_data,
+                         const dut_op_t *op,
+                         int counter)
+{
+    int64_t before[N_COUNTERS], after[N_COUNTERS];
+    for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+        op->setup(*(uint16_t *) (input_data + i * CHUNK_SIZE) % DUT_MAX_SIZE);
+        if (counter >= 0) {
+            bool ok = counters_read(before);
+            op->measure();
+            ok &= counters_read(after);
+            before_ticks[i] = before[counter];
+            after_ticks[i] = after[counter];
+            if (!ok)
+                return op->teardown() ? MEASURE_STOPPED : MEASURE_WRONG;
+        } else {
             before_ticks[i] = cpucycles();
-            dut_size(1);
+            op->measure();
             after_ticks[i] = cpucycles();
-            dut_free();
         }
+        if (!op->teardown())
+            return MEASURE_WRONG;
     }
-    return true;
+    return MEASURE_OK;
+}
+
+bool measure(int64_t *before_ticks,
+             int64_t *after_ticks,
+             uint8_t *input_data,
+             int mode)
+{
+    assert(mode >= 0 && mode < DUT_COUNT);
+    const dut_op_t *op = &dut_ops[mode];
+    assert(op->setup && op->measure && op->teardown);
+
+    int counter = dudect_counter >= 0 && dudect_counter < N_COUNTERS
+                      ? dudect_counter
+                      : COUNTER_CYCLES;
+    if (!counters_open() || !counters_supported(counter))
+        counter = -1;
+
+    int result =
+        measure_batch(before_ticks, after_ticks, input_data, op, counter);
+    if (result != MEASURE_STOPPED)
+        return result == MEASURE_OK;
+
+    /* The counters were not scheduled for the whole batch.  Rather than mix
+     * counter and cycle readings, take the whole batch again with cycles.
+     */
+    static bool warned = false;
+    if (!warned)
+        report(1, "Warning: %s counter is not running all the time, "
+                  "measuring with cpucycles instead",
+               counter_names[counter]);
+    warned = true;
+    return measure_batch(before_ticks, after_ticks, input_data, op, -1) ==
+           MEASURE_OK;
 }
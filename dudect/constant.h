@@ -12,11 +12,15 @@
 
 #define DROP_SIZE 20
 
+/* Operations under test.  Each entry needs a row in dut_ops (constant.c) */
 #define DUT_FUNCS  \
     _(insert_head) \
     _(insert_tail) \
     _(remove_head) \
-    _(remove_tail)
+    _(remove_tail) \
+    _(size)        \
+    _(delete_mid)  \
+    _(swap)
 
 #define DUT(x) DUT_##x
 
@@ -24,9 +28,32 @@ enum {
 #define _(x) DUT(x),
     DUT_FUNCS
 #undef _
+    DUT_COUNT,
 };
 
+/* One sample of an operation under test.  setup() provides a queue of n
+ * elements, where n is chosen from the sample's class, measure() is the
+ * timed call, and teardown() checks the outcome and releases the queue.
+ */
+typedef struct {
+    const char *name;
+    void (*setup)(int n);
+    void (*measure)(void);
+    bool (*teardown)(void);
+} dut_op_t;
+
+/* Counter compared between classes (a counter_t), when perf is available */
+extern int dudect_counter;
+
+/* Reuse queues between samples, resizing them instead of rebuilding */
+extern int dudect_pool;
+
+/* Return the mode of the named operation, or -1 if unknown */
+int dut_lookup(const char *name);
+const char *dut_name(int mode);
+
 void init_dut();
+void free_dut(void);
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
@@ -4,11 +4,20 @@
 #include <stdint.h>
 
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
+/* Serialized on both sides: rdtscp waits for all earlier instructions to
+ * complete, and lfence keeps later ones from starting before the read.  This
+ * is the fallback when perf counters (perf.h) are unavailable.
+ */
 static inline int64_t cpucycles(void)
 {
 #if defined(__i386__) || defined(__x86_64__)
-    unsigned int hi, lo;
-    __asm__ volatile("rdtsc\n\t" : "=a"(lo), "=d"(hi));
+    unsigned int hi, lo, aux;
+    __asm__ volatile("rdtscp\n\t"
+                     "lfence\n\t"
+                     : "=a"(lo), "=d"(hi), "=c"(aux)
+                     :
+                     : "memory");
+    (void) aux;
     return ((int64_t) lo) | (((int64_t) hi) << 32);
 
 #elif defined(__aarch64__)
@@ -19,7 +28,7 @@ static inline int64_t cpucycles(void)
      * bits wide and it is attributed with the flag 'cap_user_time_short'
      * is true.
      */
-    asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+    asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(val) : : "memory");
     return val;
 #else
 #error Unsupported Architecture
@@ -26,15 +26,23 @@
  *    variable time.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE /* sched_setaffinity */
+#include <sched.h>
+#endif
+
 #include <assert.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "../console.h"
 #include "../random.h"
+#include "../report.h"
 
 #include "constant.h"
 #include "fixture.h"
@@ -42,8 +50,45 @@
 
 #define ENOUGH_MEASURE 10000
 #define TEST_TRIES 10
+#define BATCHES (ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1)
+#define MAX_WORKERS 64
+
+/* Cropping percentiles, spread so that most of them cut the far right tail */
+#define N_PERCENTILES 100
+/* Raw timings, one test per crop, and the second-order test */
+#define N_TESTS (1 + N_PERCENTILES + 1)
+#define SECOND_ORDER (N_TESTS - 1)
+/* Class mean samples needed before centering the second-order test on it */
+#define SECOND_ORDER_AFTER (ENOUGH_MEASURE / 20)
+/* Samples a test needs before its t value is reported */
+#define TEST_ENOUGH (ENOUGH_MEASURE / 10)
+
+/* Sequential mode judges every test after each round, against boundaries
+ * that hold however many rounds are looked at (see seq_verdict()).
+ * Undecided tries end at SEQ_MAX_MEASURE and are judged like fixed-length
+ * ones.
+ */
+#define SEQ_MAX_MEASURE (4 * ENOUGH_MEASURE)
+/* Samples around which the boundaries are tightest */
+#define SEQ_RHO TEST_ENOUGH
+/* Chance of passing a leak that a fixed-length try would just catch */
+#define SEQ_PASS_ALPHA 0.01
+
+/* Measurement processes per try; 0, the default, means one per available
+ * CPU.  On a single CPU this measures in the qtest process itself.
+ */
+int dudect_workers = 0;
+
+/* Stop each try as soon as its verdict is clear */
+int dudect_sequential = 0;
 
 static t_context_t *t;
+/* Cropping thresholds, taken once per try from a calibration batch */
+static int64_t percentiles[N_PERCENTILES];
+
+/* Outcome of the most recent call to report_t() */
+static double last_max_t = 0;
+static double last_measurements = 0;
 
 /* threshold values for Welch's t-test */
 enum {
@@ -64,24 +109,124 @@ static void differentiate(int64_t *exec_times,
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
+static int cmp(const int64_t *a, const int64_t *b)
+{
+    return (*a > *b) - (*a < *b);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(const int64_t *a_sorted, double which, size_t size)
+{
+    size_t array_position = (size_t) ((double) size * (double) which);
+    assert(array_position < size);
+    return a_sorted[array_position];
+}
+
+/* Set the cropping thresholds from the pooled timings of both classes, with
+ * values that are spread more densely towards the right tail
+ */
+static void prepare_percentiles(const int64_t *exec_times)
+{
+    int64_t sorted[N_MEASURES];
+    size_t n = 0;
+    for (size_t i = 0; i < N_MEASURES; i++) {
+        if (exec_times[i] > 0)
+            sorted[n++] = exec_times[i];
+    }
+    if (!n) {
+        for (size_t i = 0; i < N_PERCENTILES; i++)
+            percentiles[i] = INT64_MAX;
+        return;
+    }
+    qsort(sorted, n, sizeof(int64_t),
+          (int (*)(const void *, const void *)) cmp);
+    for (size_t i = 0; i < N_PERCENTILES; i++) {
+        percentiles[i] = percentile(
+            sorted, 1 - (pow(0.5, 10 * (double) (i + 1) / N_PERCENTILES)), n);
+    }
+}
+
+/* Number of the n sorted samples in x below limit */
+static size_t count_below(const double *x, size_t n, int64_t limit)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (x[mid] < (double) limit)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
 static void update_statistics(const int64_t *exec_times, uint8_t *classes)
 {
+    /* Split the batch by class and sort each part, so that every cropped
+     * test takes a prefix of it and all tests are fed with t_push_batch.
+     */
+    static double samples[2][N_MEASURES];
+    size_t count[2] = {0, 0};
     for (size_t i = 0; i < N_MEASURES; i++) {
         int64_t difference = exec_times[i];
         /* CPU cycle counter overflowed or dropped measurement */
         if (difference <= 0)
             continue;
+        samples[classes[i]][count[classes[i]]++] = difference;
+    }
+
+    for (uint8_t class = 0; class < 2; class ++) {
+        double *x = samples[class];
+        size_t n = count[class];
+        qsort(x, n, sizeof(double), cmp_double);
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push_batch(&t[0], x, n, class);
+
+        /* do a t-test on cropped execution times, for several cropping
+         * thresholds
+         */
+        for (size_t crop = 0; crop < N_PERCENTILES; crop++) {
+            t_push_batch(&t[crop + 1], x, count_below(x, n, percentiles[crop]),
+                         class);
+        }
+
+        /* do a second-order test, once the class means are meaningful */
+        if (t[0].n[class] > SECOND_ORDER_AFTER) {
+            double mean = t[0].mean[class];
+            for (size_t i = 0; i < n; i++)
+                x[i] = (x[i] - mean) * (x[i] - mean);
+            t_push_batch(&t[SECOND_ORDER], x, n, class);
+        }
     }
 }
 
-static bool report(void)
+/* Largest |t| among the tests with enough samples */
+static double max_test(void)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
+    double max_t = 0;
+    for (size_t i = 0; i < N_TESTS; i++) {
+        if (t[i].n[0] + t[i].n[1] < TEST_ENOUGH)
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (x > max_t)
+            max_t = x;
+    }
+    return max_t;
+}
+
+static bool report_t(void)
+{
+    double max_t = max_test();
+    double number_traces_max_t = t[0].n[0] + t[0].n[1];
     double max_tau = max_t / sqrt(number_traces_max_t);
+    last_max_t = max_t;
+    last_measurements = number_traces_max_t;
 
     printf("\033[A\033[2K");
     printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
@@ -116,60 +261,320 @@ static bool report(void)
     return true;
 }
 
-static bool doit(int mode)
+/* Buffers for one batch of measurements, allocated once per test and
+ * reused by every batch and try, so that the allocator stays out of the
+ * measurement loop
+ */
+typedef struct {
+    int64_t *before_ticks;
+    int64_t *after_ticks;
+    int64_t *exec_times;
+    uint8_t *classes;
+    uint8_t *input_data;
+    void *block;
+} batch_buffers_t;
+
+static batch_buffers_t buf;
+
+#define CACHE_LINE 64
+#define LINE_ALIGN(size) \
+    (((size) + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1))
+
+static void alloc_buffers(void)
 {
-    int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
-    uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
-    uint8_t *input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
+    size_t ticks = LINE_ALIGN((N_MEASURES + 1) * sizeof(int64_t));
+    size_t times = LINE_ALIGN(N_MEASURES * sizeof(int64_t));
+    size_t classes = LINE_ALIGN(N_MEASURES * sizeof(uint8_t));
+    size_t input = LINE_ALIGN(N_MEASURES * CHUNK_SIZE * sizeof(uint8_t));
+    size_t total = 2 * ticks + times + classes + input;
 
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
+    if (posix_memalign(&buf.block, CACHE_LINE, total))
         die();
-    }
+    /* Touch every page now rather than on the first timed batch */
+    memset(buf.block, 0, total);
+
+    uint8_t *p = buf.block;
+    buf.before_ticks = (int64_t *) p;
+    p += ticks;
+    buf.after_ticks = (int64_t *) p;
+    p += ticks;
+    buf.exec_times = (int64_t *) p;
+    p += times;
+    buf.classes = p;
+    p += classes;
+    buf.input_data = p;
+}
 
-    prepare_inputs(input_data, classes);
+static void free_buffers(void)
+{
+    free(buf.block);
+    buf.block = NULL;
+}
 
-    bool ret = measure(before_ticks, after_ticks, input_data, mode);
-    differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    ret &= report();
+/* Take one batch of measurements into t without judging them */
+static bool collect(int mode)
+{
+    prepare_inputs(buf.input_data, buf.classes);
 
-    free(before_ticks);
-    free(after_ticks);
-    free(exec_times);
-    free(classes);
-    free(input_data);
+    bool ret = measure(buf.before_ticks, buf.after_ticks, buf.input_data, mode);
+    differentiate(buf.exec_times, buf.before_ticks, buf.after_ticks);
+    update_statistics(buf.exec_times, buf.classes);
 
     return ret;
 }
 
+/* Measure one batch only to set the cropping thresholds for this try.  Every
+ * worker then crops at the same points, and no test sees these samples.
+ */
+static void calibrate(int mode)
+{
+    prepare_inputs(buf.input_data, buf.classes);
+    measure(buf.before_ticks, buf.after_ticks, buf.input_data, mode);
+    differentiate(buf.exec_times, buf.before_ticks, buf.after_ticks);
+    prepare_percentiles(buf.exec_times);
+}
+
+static bool doit(int mode)
+{
+    bool ret = collect(mode);
+    return report_t() && ret;
+}
+
+/* CPUs this process may run on, in the order workers are pinned to them */
+static int available_cpus(int *cpus, int max)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    int cnt = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && cnt < max; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                cpus[cnt++] = cpu;
+        }
+    }
+    return cnt ? cnt : 1;
+#else
+    (void) cpus;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > max ? max : n;
+#endif
+}
+
+typedef struct {
+    t_context_t t[N_TESTS];
+    bool ok;
+} worker_result_t;
+
+/* Spread batches over worker processes, each pinned to its own CPU with a
+ * private accumulator, and merge their moments into t.  Workers are
+ * processes rather than threads because the allocation harness behind the
+ * queue code keeps global state.
+ */
+static bool run_workers(int mode,
+                        int batches,
+                        int workers,
+                        const int *cpus,
+                        int ncpus)
+{
+    pid_t pids[MAX_WORKERS];
+    int fds[MAX_WORKERS];
+    bool ok = true;
+    int started = 0;
+
+    fflush(stdout);
+    for (int w = 0; w < workers; w++) {
+        int pipefd[2];
+        if (pipe(pipefd) < 0)
+            break;
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            break;
+        }
+        if (pid == 0) {
+            close(pipefd[0]);
+#if defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[w % ncpus], &set);
+            sched_setaffinity(0, sizeof(set), &set);
+#endif
+            worker_result_t res = {.ok = true};
+            for (int i = 0; i < N_TESTS; i++)
+                t_init(&t[i]);
+            for (int i = w; i < batches; i += workers)
+                res.ok &= collect(mode);
+            memcpy(res.t, t, sizeof(res.t));
+            ssize_t n = write(pipefd[1], &res, sizeof(res));
+            _exit(n == sizeof(res) ? 0 : 1);
+        }
+        close(pipefd[1]);
+        pids[started] = pid;
+        fds[started++] = pipefd[0];
+    }
+
+    /* Batches of workers that never started are simply missing; report_t()
+     * asks for more if that leaves too few measurements.
+     */
+    for (int w = 0; w < started; w++) {
+        worker_result_t res;
+        size_t got = 0;
+        while (got < sizeof(res)) {
+            ssize_t n = read(fds[w], (char *) &res + got, sizeof(res) - got);
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        close(fds[w]);
+        int status;
+        waitpid(pids[w], &status, 0);
+        if (got != sizeof(res) || !WIFEXITED(status) ||
+            WEXITSTATUS(status)) {
+            ok = false;
+            continue;
+        }
+        for (int i = 0; i < N_TESTS; i++)
+            t_merge(&t[i], &res.t[i]);
+        ok &= res.ok;
+    }
+    return ok && started > 0;
+}
+
+/* Sequential verdicts: SEQ_LEAK is certain enough to end the whole test,
+ * SEQ_FAIL leaves room for another try
+ */
+enum { SEQ_MORE, SEQ_PASS, SEQ_FAIL, SEQ_LEAK, SEQ_WRONG };
+
+/* Radius that a t value of a test without a leak, after n samples, exceeds
+ * at any look with probability at most exp(log_alpha).  This is Robbins'
+ * normal mixture boundary: it grows like sqrt(log n), whereas a fixed
+ * threshold is eventually crossed by chance if looked at often enough.
+ */
+static double seq_boundary(double n, double log_alpha)
+{
+    return sqrt((1 + SEQ_RHO / n) * (log(1 + n / SEQ_RHO) - 2 * log_alpha));
+}
+
+/* Judge the tests of a try in progress, splitting each error rate evenly
+ * between the N_TESTS tests
+ */
+static int seq_verdict(void)
+{
+    /* A single look at t_threshold_moderate flags a constant-time
+     * function with probability about exp(-moderate^2 / 2); rejection
+     * keeps that rate over all looks.
+     */
+    double log_leak = -0.5 * t_threshold_moderate * t_threshold_moderate -
+                      log((double) N_TESTS);
+    double log_pass = log(SEQ_PASS_ALPHA / N_TESTS);
+    /* The smallest leak a fixed-length try catches has a t value of
+     * t_threshold_moderate after ENOUGH_MEASURE samples, and t grows with
+     * the square root of the samples
+     */
+    double smallest =
+        t_threshold_moderate * sqrt(last_measurements / ENOUGH_MEASURE);
+    bool pass = last_measurements >= TEST_ENOUGH;
+
+    for (size_t i = 0; i < N_TESTS; i++) {
+        double n = t[i].n[0] + t[i].n[1];
+        if (n < TEST_ENOUGH)
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (x > seq_boundary(n, log_leak))
+            return SEQ_LEAK;
+        /* Pass once the leak is bounded below the smallest one */
+        if (x + seq_boundary(n, log_pass) >= smallest)
+            pass = false;
+    }
+    if (pass)
+        return SEQ_PASS;
+    if (last_measurements >= SEQ_MAX_MEASURE)
+        return last_max_t < t_threshold_moderate ? SEQ_PASS : SEQ_FAIL;
+    return SEQ_MORE;
+}
+
+/* Run one try round by round until the verdict is clear, each round taking
+ * one batch per worker
+ */
+static int run_sequential(int mode, int workers, const int *cpus, int ncpus)
+{
+    for (;;) {
+        bool ok = workers > 1 ? run_workers(mode, workers, workers, cpus, ncpus)
+                              : collect(mode);
+        report_t();
+        if (!ok)
+            return SEQ_WRONG;
+        int verdict = seq_verdict();
+        if (verdict != SEQ_MORE)
+            return verdict;
+    }
+}
+
 static void init_once(void)
 {
     init_dut();
-    t_init(t);
+    for (int i = 0; i < N_TESTS; i++)
+        t_init(&t[i]);
 }
 
 static bool test_const(char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_context_t));
+    int cnt;
+    int cpus[MAX_WORKERS];
+    int ncpus = available_cpus(cpus, MAX_WORKERS);
+    int workers = dudect_workers > 0 ? dudect_workers : ncpus;
+    if (workers > MAX_WORKERS)
+        workers = MAX_WORKERS;
+    t = malloc(N_TESTS * sizeof(t_context_t));
+    alloc_buffers();
 
-    for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
+    for (cnt = 0; cnt < TEST_TRIES; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
         init_once();
-        for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
-             ++i)
-            result = doit(mode);
+        calibrate(mode);
+        if (dudect_sequential) {
+            int verdict = run_sequential(mode, workers, cpus, ncpus);
+            result = verdict == SEQ_PASS;
+            printf("\033[A\033[2K\033[A\033[2K");
+            /* Only a try that ran out undecided is worth another */
+            if (verdict != SEQ_FAIL)
+                break;
+            continue;
+        }
+        if (workers > 1) {
+            bool ok = run_workers(mode, BATCHES, workers, cpus, ncpus);
+            result = report_t() && ok;
+        } else {
+            for (int i = 0; i < BATCHES; ++i)
+                result = doit(mode);
+        }
         printf("\033[A\033[2K\033[A\033[2K");
         if (result)
             break;
     }
+    if (dudect_sequential)
+        printf("%s: decided after %.0f measurements, max t %.2f\n", text,
+               last_measurements, last_max_t);
+    free_dut();
+    free_buffers();
     free(t);
+
+    if (json_enabled())
+        report_json(
+            "\"dudect\": \"%s\", \"result\": %s, \"tries\": %d, "
+            "\"measurements\": %.0f, \"max_t\": %.3f",
+            text, result ? "true" : "false", cnt < TEST_TRIES ? cnt + 1 : cnt,
+            last_measurements, last_max_t);
     return result;
 }
 
+bool is_op_const(int mode)
+{
+    return test_const((char *) dut_name(mode), mode);
+}
+
 #define DUT_FUNC_IMPL(op) \
     bool is_##op##_const(void) { return test_const(#op, DUT(op)); }
 
@@ -4,9 +4,23 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Measurement processes per test; 0, the default, means one per available
+ * CPU
+ */
+extern int dudect_workers;
+
+/* Stop each try as soon as its verdict is clear, rather than after a fixed
+ * number of measurements.  With several workers, each round of a sequential
+ * try takes one batch per worker.
+ */
+extern int dudect_sequential;
+
 /* Interface to test if function is constant */
 #define _(x) bool is_##x##_const(void);
 DUT_FUNCS
 #undef _
 
+/* Test an operation by its DUT() mode, e.g. one found with dut_lookup() */
+bool is_op_const(int mode);
+
 #endif
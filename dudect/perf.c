@@ -0,0 +1,163 @@
+/* perf_event_open backend for dudect and qtest timing.
+ *
+ * Unlike the time stamp counter, these count core cycles of this process
+ * only, so they are immune to frequency scaling and to time spent in other
+ * tasks.  All events are opened as one group and read with a single read()
+ * so that their values are taken at the same instant.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perf.h"
+
+const char *counter_names[N_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "cache misses",
+    "branch misses",
+};
+
+#if defined(__linux__)
+
+static const uint64_t counter_configs[N_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int fds[N_COUNTERS] = {-1, -1, -1, -1};
+/* Position of each counter in a group read, -1 if it could not be opened */
+static int slot[N_COUNTERS];
+static int nr_open = 0;
+static pid_t owner = 0;
+/* Set once opening failed for this process, to avoid retrying per sample */
+static pid_t failed = 0;
+/* This process, cached so that reads in the measured path make no syscall;
+ * refreshed in the child of every fork()
+ */
+static pid_t self = 0;
+
+static void refresh_self(void)
+{
+    self = getpid();
+}
+
+static pid_t current_pid(void)
+{
+    if (!self) {
+        pthread_atfork(NULL, NULL, refresh_self);
+        refresh_self();
+    }
+    return self;
+}
+
+static int open_counter(uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+void counters_close(void)
+{
+    for (int i = 0; i < N_COUNTERS; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+    nr_open = 0;
+    owner = 0;
+}
+
+bool counters_open(void)
+{
+    pid_t pid = current_pid();
+    if (owner == pid)
+        return true;
+    if (failed == pid)
+        return false;
+
+    /* Descriptors inherited across fork() still count the parent */
+    counters_close();
+
+    fds[0] = open_counter(counter_configs[0], -1);
+    if (fds[0] < 0) {
+        failed = pid;
+        return false;
+    }
+    slot[0] = nr_open++;
+    for (int i = 1; i < N_COUNTERS; i++) {
+        fds[i] = open_counter(counter_configs[i], fds[0]);
+        slot[i] = fds[i] < 0 ? -1 : nr_open++;
+    }
+
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    owner = pid;
+    return true;
+}
+
+bool counters_supported(int counter)
+{
+    return owner && owner == self && counter >= 0 && counter < N_COUNTERS &&
+           slot[counter] >= 0;
+}
+
+bool counters_read(int64_t values[N_COUNTERS])
+{
+    /* Number of events, time enabled, time running, then the values */
+    uint64_t buf[3 + N_COUNTERS];
+    if (!owner || owner != self ||
+        read(fds[0], buf, sizeof(buf)) < (ssize_t) (3 * sizeof(uint64_t)))
+        return false;
+    /* A group that was never scheduled reads zero, and one that has been
+     * multiplexed with other events missed part of what it should count
+     */
+    if (!buf[2] || buf[2] < buf[1])
+        return false;
+    for (int i = 0; i < N_COUNTERS; i++)
+        values[i] = slot[i] >= 0 && (uint64_t) slot[i] < buf[0]
+                        ? (int64_t) buf[3 + slot[i]]
+                        : 0;
+    return true;
+}
+
+#else /* No perf_event_open */
+
+bool counters_open(void)
+{
+    return false;
+}
+
+void counters_close(void) {}
+
+bool counters_supported(int counter)
+{
+    (void) counter;
+    return false;
+}
+
+bool counters_read(int64_t values[N_COUNTERS])
+{
+    memset(values, 0, N_COUNTERS * sizeof(int64_t));
+    return false;
+}
+
+#endif
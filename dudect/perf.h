@@ -0,0 +1,35 @@
+#ifndef DUDECT_PERF_H
+#define DUDECT_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware events read through perf_event_open */
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    N_COUNTERS,
+} counter_t;
+
+extern const char *counter_names[N_COUNTERS];
+
+/* Open the counters for the calling process, reopening them after fork.
+ * Returns false when hardware counters are unavailable, e.g. in a virtual
+ * machine or with a restrictive perf_event_paranoid, in which case callers
+ * fall back to cpucycles().
+ */
+bool counters_open(void);
+void counters_close(void);
+
+/* Whether counter could be opened along with the cycle counter */
+bool counters_supported(int counter);
+
+/* Snapshot every counter; events the CPU cannot count read as zero.
+ * Returns false when the group is not counting all the time, i.e. it was
+ * never scheduled or has been multiplexed with other events.
+ */
+bool counters_read(int64_t values[N_COUNTERS]);
+
+#endif
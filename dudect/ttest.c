@@ -10,6 +10,7 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "ttest.h"
@@ -27,6 +28,54 @@ void t_push(t_context_t *ctx, double x, uint8_t class)
     ctx->m2[class] = ctx->m2[class] + delta * (x - ctx->mean[class]);
 }
 
+/* Number of independent partial sums kept by t_push_batch, so that the
+ * additions do not serialize on a single accumulator
+ */
+#define BATCH_LANES 4
+
+/* Push n samples of one class at once.  The batch mean and m2 come from
+ * two divide-free passes over x, which are then folded into ctx by the same
+ * pairwise combination t_merge uses.
+ */
+void t_push_batch(t_context_t *ctx,
+                  const double *x,
+                  size_t n,
+                  uint8_t class)
+{
+    assert(class == 0 || class == 1);
+    if (n == 0)
+        return;
+
+    double sum[BATCH_LANES] = {0.0};
+    size_t i = 0;
+    for (; i + BATCH_LANES <= n; i += BATCH_LANES) {
+        for (int k = 0; k < BATCH_LANES; k++)
+            sum[k] += x[i + k];
+    }
+    for (; i < n; i++)
+        sum[0] += x[i];
+    double mean = (sum[0] + sum[1] + sum[2] + sum[3]) / n;
+
+    double m2[BATCH_LANES] = {0.0};
+    for (i = 0; i + BATCH_LANES <= n; i += BATCH_LANES) {
+        for (int k = 0; k < BATCH_LANES; k++) {
+            double delta = x[i + k] - mean;
+            m2[k] += delta * delta;
+        }
+    }
+    for (; i < n; i++) {
+        double delta = x[i] - mean;
+        m2[0] += delta * delta;
+    }
+
+    t_context_t batch;
+    t_init(&batch);
+    batch.n[class] = n;
+    batch.mean[class] = mean;
+    batch.m2[class] = m2[0] + m2[1] + m2[2] + m2[3];
+    t_merge(ctx, &batch);
+}
+
 double t_compute(t_context_t *ctx)
 {
     double var[2] = {0.0, 0.0};
@@ -47,3 +96,20 @@ void t_init(t_context_t *ctx)
     }
     return;
 }
+
+/* Fold the moments accumulated in src into dst, as if every sample pushed
+ * to src had been pushed to dst.  Pairwise combination by Chan et al.
+ */
+void t_merge(t_context_t *dst, const t_context_t *src)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = dst->n[class] + src->n[class];
+        if (n == 0)
+            continue;
+        double delta = src->mean[class] - dst->mean[class];
+        dst->mean[class] += delta * src->n[class] / n;
+        dst->m2[class] += src->m2[class] +
+                          delta * delta * dst->n[class] * src->n[class] / n;
+        dst->n[class] = n;
+    }
+}
@@ -1,6 +1,7 @@
 #ifndef DUDECT_TTEST_H
 #define DUDECT_TTEST_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct {
@@ -10,7 +11,12 @@ typedef struct {
 } t_context_t;
 
 void t_push(t_context_t *ctx, double x, uint8_t class);
+void t_push_batch(t_context_t *ctx,
+                  const double *x,
+                  size_t n,
+                  uint8_t class);
 double t_compute(t_context_t *ctx);
 void t_init(t_context_t *ctx);
+void t_merge(t_context_t *dst, const t_context_t *src);
 
 #endif
@@ -5,8 +5,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -24,6 +26,9 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/* Value at start of block placed against a guard page */
+#define MAGICGUARD 0xdeadfeed
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
@@ -43,15 +48,25 @@ typedef struct __block_element {
 static block_element_t *allocated = NULL;
 static size_t allocated_count = 0;
 
+/* Bytes of payload currently allocated, and peak of payload plus overhead */
+static size_t allocated_bytes = 0;
+static size_t peak_allocated_bytes = 0;
+
+/* Bookkeeping added to every block: header in front, footer at the end */
+#define BLOCK_OVERHEAD (sizeof(block_element_t) + sizeof(size_t))
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Place 1 in N blocks against a guard page (0 = never) */
+int guard_interval = 0;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+int time_limit = 1;
 
 /* Data for managing exceptions */
 static jmp_buf env;
@@ -63,8 +78,55 @@ static bool time_limited = false;
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    return fail_probability > 0 && randombounded(100) < fail_probability;
+}
+
+/* Should this allocation be placed against a guard page? */
+static bool guard_allocation()
+{
+    return guard_interval > 0 && randombounded(guard_interval) == 0;
+}
+
+/* Map a block whose payload ends exactly where an inaccessible page begins,
+ * so that writing past the end faults immediately instead of being found
+ * later by the footer check.  Because the size of any object is a multiple of
+ * its alignment, the right-aligned payload stays suitably aligned.  The
+ * header sits just below the payload, rounded down to its own alignment.
+ * Return NULL if the mapping could not be set up.
+ */
+static block_element_t *guard_alloc(size_t size, void **payload)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t need = size + sizeof(block_element_t) + sizeof(size_t);
+    size_t len = (need + page - 1) / page * page + page;
+
+    char *base =
+        mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    char *guard = base + len - page;
+    if (mprotect(guard, page, PROT_NONE)) {
+        munmap(base, len);
+        return NULL;
+    }
+
+    *payload = guard - size;
+    return (block_element_t *) (((size_t) *payload -
+                                 sizeof(block_element_t)) &
+                                ~(sizeof(size_t) - 1));
+}
+
+/* Release mapping created by guard_alloc, given header and payload */
+static void guard_free(block_element_t *b, void *p)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t need = b->payload_size + sizeof(block_element_t) + sizeof(size_t);
+    /* Same layout as guard_alloc: the payload ends at the guard page */
+    char *guard = (char *) p + b->payload_size;
+    char *base = guard - (need + page - 1) / page * page;
+    munmap(base, guard + page - base);
 }
 
 /* Find header of block, given its payload.
@@ -77,8 +139,12 @@ static block_element_t *find_header(void *p)
         error_occurred = true;
     }
 
+    /* Regular payloads directly follow the header and are already aligned;
+     * guarded ones may leave a few bytes of slack in between.
+     */
     block_element_t *b =
-        (block_element_t *) ((size_t) p - sizeof(block_element_t));
+        (block_element_t *) (((size_t) p - sizeof(block_element_t)) &
+                             ~(sizeof(size_t) - 1));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
         block_element_t *ab = allocated;
@@ -95,7 +161,7 @@ static block_element_t *find_header(void *p)
         }
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (b->magic_header != MAGICHEADER && b->magic_header != MAGICGUARD) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
@@ -129,19 +195,26 @@ void *test_malloc(size_t size)
         return NULL;
     }
 
+    void *p = NULL;
     block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
-    if (!new_block) {
-        report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
-    }
+        guard_allocation() ? guard_alloc(size, &p) : NULL;
+    if (new_block) {
+        new_block->magic_header = MAGICGUARD;
+        new_block->payload_size = size;
+    } else {
+        new_block = malloc(size + sizeof(block_element_t) + sizeof(size_t));
+        if (!new_block) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+        }
 
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
+        // cppcheck-suppress nullPointerRedundantCheck
+        new_block->magic_header = MAGICHEADER;
+        // cppcheck-suppress nullPointerRedundantCheck
+        new_block->payload_size = size;
+        *find_footer(new_block) = MAGICFOOTER;
+        p = (void *) &new_block->payload;
+    }
     memset(p, FILLCHAR, size);
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->next = allocated;
@@ -152,6 +225,11 @@ void *test_malloc(size_t size)
         allocated->prev = new_block;
     allocated = new_block;
     allocated_count++;
+    allocated_bytes += size;
+
+    size_t total_bytes = allocated_bytes + allocated_count * BLOCK_OVERHEAD;
+    if (total_bytes > peak_allocated_bytes)
+        peak_allocated_bytes = total_bytes;
 
     return p;
 }
@@ -179,17 +257,20 @@ void test_free(void *p)
         return;
 
     block_element_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+    bool guarded = b->magic_header == MAGICGUARD;
+    if (!guarded) {
+        size_t footer = *find_footer(b);
+        if (footer != MAGICFOOTER) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p when "
+                         "attempting to free it",
+                         p);
+            error_occurred = true;
+        }
+        *find_footer(b) = MAGICFREE;
+        memset(p, FILLCHAR, b->payload_size);
     }
     b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
 
     /* Unlink from list */
     block_element_t *bn = b->next;
@@ -201,7 +282,11 @@ void test_free(void *p)
     if (bn)
         bn->prev = bp;
 
-    free(b);
+    allocated_bytes -= b->payload_size;
+    if (guarded)
+        guard_free(b, p);
+    else
+        free(b);
     allocated_count--;
 }
 
@@ -221,6 +306,21 @@ size_t allocation_check()
     return allocated_count;
 }
 
+size_t allocation_bytes()
+{
+    return allocated_bytes;
+}
+
+size_t allocation_peak_bytes()
+{
+    return peak_allocated_bytes;
+}
+
+size_t allocation_overhead()
+{
+    return BLOCK_OVERHEAD;
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
@@ -21,9 +21,26 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Report number of payload bytes held by allocated blocks */
+size_t allocation_bytes();
+
+/* Report peak number of bytes, payload plus overhead, held at any time */
+size_t allocation_peak_bytes();
+
+/* Report bytes of bookkeeping (header + footer) added to every block */
+size_t allocation_overhead();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Place 1 in N blocks against an inaccessible guard page, so that overruns
+ * fault immediately (0 = never)
+ */
+extern int guard_interval;
+
+/* Seconds a queue operation may run before being interrupted (0 = no limit) */
+extern int time_limit;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -19,12 +20,17 @@
 #include <time.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
 
 /* Shannon entropy */
 extern double shannon_entropy(const uint8_t *input_data);
+extern double shannon_entropy_buckets(const uint64_t *bucket, uint64_t count);
 extern int show_entropy;
 
 /* Our program needs to use regular malloc/free */
@@ -75,8 +81,18 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Verify every freed block against the allocation list (O(n) per free) */
+static int cautious = 1;
+
+/* Seed of the random stream for RAND strings and injected malloc failures
+ * (0 = unpredictable)
+ */
+static int seed = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
+/* RAND strings generated per call of fill_rand_strings */
+#define RANDSTR_BATCH 256
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 /* For queue_insert and queue_remove */
 typedef enum {
@@ -116,7 +132,7 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
+        set_cautious_mode(cautious);
     }
 
     if (current) {
@@ -163,42 +179,95 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
-/* TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
+/* Fill count buffers of MAX_RANDSTR_LEN bytes with random lowercase strings
+ * of MIN_RANDSTR_LEN to MAX_RANDSTR_LEN - 1 characters.  Each character and
+ * each length is a 16-bit random value scaled down by multiply-shift, so
+ * there is neither a modulo nor a rejection loop.  The mapping is not quite
+ * uniform: as 26 and 5 do not divide 65536, the chance of each letter or
+ * length is off by less than 1/65536, which RAND strings can live with.
+ */
+static void fill_rand_strings(char (*strs)[MAX_RANDSTR_LEN], size_t count)
+{
+    static uint16_t rnd[RANDSTR_BATCH * (MAX_RANDSTR_LEN + 1)];
+    const size_t letters = sizeof(charset) - 1;
+    const size_t lengths = MAX_RANDSTR_LEN - MIN_RANDSTR_LEN;
+    assert(count <= RANDSTR_BATCH);
+
+    /* One value per byte of the buffers, then one length per string */
+    size_t n = count * MAX_RANDSTR_LEN;
+    randombytes((uint8_t *) rnd, (n + count) * sizeof(uint16_t));
+
+    uint8_t *out = (uint8_t *) strs;
+    size_t i = 0;
+#if defined(__SSE2__)
+    /* charset is the contiguous lowercase alphabet: 16 letters at a time */
+    const __m128i scale = _mm_set1_epi16(letters);
+    const __m128i base = _mm_set1_epi8('a');
+    for (; i + 16 <= n; i += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i *) (rnd + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *) (rnd + i + 8));
+        __m128i idx = _mm_packus_epi16(_mm_mulhi_epu16(lo, scale),
+                                       _mm_mulhi_epu16(hi, scale));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_add_epi8(idx, base));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = charset[(rnd[i] * letters) >> 16];
+    for (i = 0; i < count; i++)
+        strs[i][MIN_RANDSTR_LEN + ((rnd[n + i] * lengths) >> 16)] = '\0';
+}
+
+/* In simulation mode, check with dudect that an operation runs in constant
+ * time instead of executing it
+ */
+static bool simulate(int mode, int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
+    /* Pooled queues keep thousands of blocks alive, and the cautious check
+     * would walk past them on every release
+     */
+    set_cautious_mode(cautious && !dudect_pool);
+    bool ok = is_op_const(mode);
+    set_cautious_mode(cautious);
+    if (!ok) {
+        report(1, "ERROR: Probably not constant time or wrong implementation");
+        return false;
+    }
+    report(1, "Probably constant time");
+    return ok;
+}
+
+/* Check any operation in the dudect table by name, including ones that have
+ * no queue command of their own
  */
-static void fill_rand_string(char *buf, size_t buf_size)
+static bool do_dudect(int argc, char *argv[])
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
-
-    randombytes((uint8_t *) buf, len);
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[buf[n] % (sizeof(charset) - 1)];
-    buf[len] = '\0';
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+    int mode = dut_lookup(argv[1]);
+    if (mode < 0) {
+        report(1, "Unknown operation '%s'.  Operations:", argv[1]);
+        for (mode = 0; dut_name(mode); mode++)
+            report(1, "  %s", dut_name(mode));
+        return false;
+    }
+    return simulate(mode, 1, argv);
 }
 
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok =
-            pos == POS_TAIL ? is_insert_tail_const() : is_insert_head_const();
-        if (!ok) {
-            report(1,
-                   "ERROR: Probably not constant time or wrong implementation");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(pos == POS_TAIL ? DUT(insert_tail) : DUT(insert_head),
+                        argc, argv);
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[RANDSTR_BATCH][MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -216,7 +285,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     if (!strcmp(inserts, "RAND")) {
         need_rand = true;
-        inserts = randstr_buf;
+        inserts = randstr_buf[0];
     }
 
     if (!current || !current->q)
@@ -226,8 +295,14 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+            if (need_rand) {
+                int k = r % RANDSTR_BATCH;
+                if (!k)
+                    fill_rand_strings(randstr_buf, reps - r < RANDSTR_BATCH
+                                                       ? reps - r
+                                                       : RANDSTR_BATCH);
+                inserts = randstr_buf[k];
+            }
             bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
                                         : q_insert_head(current->q, inserts);
             if (rval) {
@@ -293,21 +368,9 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
      * We shall figure out the exact reasons and resolve later.
      */
 #if !(defined(__aarch64__) && defined(__APPLE__))
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok =
-            pos == POS_TAIL ? is_remove_tail_const() : is_remove_head_const();
-        if (!ok) {
-            report(1,
-                   "ERROR: Probably not constant time or wrong implementation");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(pos == POS_TAIL ? DUT(remove_tail) : DUT(remove_head),
+                        argc, argv);
 #endif
 
     if (argc != 1 && argc != 2) {
@@ -533,6 +596,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(DUT(size), argc, argv);
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -631,6 +697,9 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(DUT(delete_mid), argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -657,6 +726,9 @@ static bool do_dm(int argc, char *argv[])
 
 static bool do_swap(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(DUT(swap), argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -966,6 +1038,150 @@ static bool do_show(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Lengths are tallied in power-of-two ranges: 0, 1, 2-3, 4-7, ... */
+#define STATS_LEN_BUCKETS 12
+
+/* FNV-1a, folded into the byte pass of do_stats */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* Record hash h in an open-addressing table of mask + 1 slots.  Return
+ * whether it was already present.  Zero marks free slots, so it is
+ * remapped.
+ */
+static bool stats_seen(uint64_t *table, size_t mask, uint64_t h)
+{
+    if (!h)
+        h = 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        if (table[i] == h)
+            return true;
+        if (!table[i]) {
+            table[i] = h;
+            return false;
+        }
+    }
+}
+
+/* Characterize the values of the whole queue in one pass: byte entropy,
+ * length distribution, duplicates and how close the queue is to sorted
+ */
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling stats on null queue");
+        return false;
+    }
+    if (!is_circular()) {
+        report(1, "ERROR:  Queue is not doubly circular");
+        return false;
+    }
+
+    /* Keep the table at most half full; duplicates are then found by 64-bit
+     * hash, whose collisions are negligible at any size a queue can reach
+     */
+    size_t slots = 16;
+    while (slots < 2 * (size_t) current->size)
+        slots <<= 1;
+    uint64_t *table = calloc(slots, sizeof(uint64_t));
+    if (!table)
+        report(1, "Warning: No memory to count duplicates");
+
+    uint64_t bucket[256] = {0};
+    int lengths[STATS_LEN_BUCKETS] = {0};
+    uint64_t bytes = 0;
+    size_t min_len = SIZE_MAX, max_len = 0;
+    double mean = 0, m2 = 0;
+    int cnt = 0, dups = 0, adjacent = 0, ascending = 0;
+    const char *prev = NULL;
+    bool ok = true;
+
+    if (exception_setup(true)) {
+        struct list_head *cur;
+        list_for_each (cur, current->q) {
+            if (cnt >= current->size) {
+                report(1, "ERROR:  Queue has more than %d elements",
+                       current->size);
+                ok = false;
+                break;
+            }
+            const char *value = list_entry(cur, element_t, list)->value;
+            if (!value)
+                value = "";
+
+            uint64_t h = FNV_OFFSET;
+            size_t len = 0;
+            for (const uint8_t *p = (const uint8_t *) value; *p; p++, len++) {
+                bucket[*p]++;
+                h = (h ^ *p) * FNV_PRIME;
+            }
+
+            cnt++;
+            bytes += len;
+            min_len = len < min_len ? len : min_len;
+            max_len = len > max_len ? len : max_len;
+            double delta = len - mean;
+            mean += delta / cnt;
+            m2 += delta * (len - mean);
+            int b = 0;
+            for (size_t l = len; l && b < STATS_LEN_BUCKETS - 1; l >>= 1)
+                b++;
+            lengths[b]++;
+
+            if (prev) {
+                int c = strcmp(prev, value);
+                adjacent += c == 0;
+                ascending += c <= 0;
+            }
+            prev = value;
+            if (table && stats_seen(table, slots - 1, h))
+                dups++;
+        }
+    }
+    exception_cancel();
+    free(table);
+
+    if (!ok)
+        return false;
+    if (!cnt) {
+        report(1, "Queue is empty");
+        return true;
+    }
+
+    report(1, "Elements: %d, bytes: %llu", cnt, (unsigned long long) bytes);
+    report(1, "Length: min %zu, max %zu, mean %.2f, stddev %.2f", min_len,
+           max_len, mean, cnt > 1 ? sqrt(m2 / (cnt - 1)) : 0.0);
+    for (int b = 0; b < STATS_LEN_BUCKETS; b++) {
+        if (!lengths[b])
+            continue;
+        size_t lo = b ? (size_t) 1 << (b - 1) : 0;
+        size_t hi = b ? ((size_t) 1 << b) - 1 : 0;
+        if (b == STATS_LEN_BUCKETS - 1)
+            report(1, "  %5zu+      %8d (%5.1f%%)", lo, lengths[b],
+                   100.0 * lengths[b] / cnt);
+        else
+            report(1, "  %5zu-%-5zu %8d (%5.1f%%)", lo, hi, lengths[b],
+                   100.0 * lengths[b] / cnt);
+    }
+    int distinct_bytes = 0;
+    for (int i = 0; i < 256; i++)
+        distinct_bytes += bucket[i] != 0;
+    report(1, "Byte entropy: %.2f%% over %d distinct byte values",
+           shannon_entropy_buckets(bucket, bytes), distinct_bytes);
+    if (table)
+        report(1, "Duplicates: %d (%.2f%%), adjacent: %d", dups,
+               100.0 * dups / cnt, adjacent);
+    if (cnt > 1)
+        report(1, "Ascending neighbours: %.2f%%",
+               100.0 * ascending / (cnt - 1));
+    return true;
+}
+
 static bool do_prev(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1012,6 +1228,416 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+static bool do_mem(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    size_t elements = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain)
+        elements += ctx->size;
+
+    size_t blocks = allocation_check();
+    size_t payload = allocation_bytes();
+    size_t overhead = blocks * allocation_overhead();
+    size_t total = payload + overhead;
+
+    report(1, "Queue storage: %zu elements in %d queue(s), %zu blocks",
+           elements, chain.size, blocks);
+    report(1, "  payload  = %zu bytes", payload);
+    report(1, "  overhead = %zu bytes (%zu per block)", overhead,
+           allocation_overhead());
+    report(1, "  peak     = %zu bytes", allocation_peak_bytes());
+    if (elements)
+        report(1, "  bytes per element = %.2f (payload %.2f)",
+               (double) total / elements, (double) payload / elements);
+    if (total)
+        report(1, "  overhead ratio = %.2f%%", 100.0 * overhead / total);
+
+    size_t current_bytes, peak_bytes, last_peak_bytes;
+    mem_usage(&current_bytes, &peak_bytes, &last_peak_bytes);
+    report(1,
+           "Console storage: current = %zu bytes, peak = %zu bytes, peak "
+           "since last check = %zu bytes",
+           current_bytes, peak_bytes, last_peak_bytes);
+
+    return true;
+}
+
+/* Describe queue state in structured output records */
+static void json_state(char *buf, size_t size)
+{
+    size_t elements = 0;
+    queue_contex_t *ctx;
+    if (chain.size) {
+        list_for_each_entry (ctx, &chain.head, chain)
+            elements += ctx->size;
+    }
+
+    snprintf(buf, size,
+             ", \"queue_size\": %zu, \"blocks\": %zu, \"bytes\": %zu, "
+             "\"peak_bytes\": %zu",
+             elements, allocation_check(), allocation_bytes(),
+             allocation_peak_bytes());
+}
+
+/* Empirical complexity fitting */
+
+/* Sizes run in half octaves from 2^MIN_LOG2 to 2^MAX_LOG2.  The nodes of
+ * 512 elements, a cache line each, fit in a 48 KB L1 cache.  Past that,
+ * every cache level adds its own cost per element, which shows up as a
+ * growth the algorithm does not have.
+ */
+#define COMPLEXITY_MIN_LOG2 5
+#define COMPLEXITY_MAX_LOG2 9
+/* Samples per size; the fastest one is kept as the least disturbed */
+#define COMPLEXITY_REPEAT 7
+#define COMPLEXITY_MIN_SIZES 4
+/* Stop growing once one sample takes longer than this */
+#define COMPLEXITY_BUDGET_NS 200000000
+/* Calls timed per sample, to rise above timer resolution */
+#define COMPLEXITY_CALLS 64
+#define COMPLEXITY_MERGE_QUEUES 4
+
+typedef enum {
+    CX_1,
+    CX_LOGN,
+    CX_N,
+    CX_NLOGN,
+    CX_N2,
+    CX_CLASSES,
+} cx_class_t;
+
+static const char *cx_names[CX_CLASSES] = {"O(1)", "O(log n)", "O(n)",
+                                           "O(n log n)", "O(n^2)"};
+static const char *cx_keys[CX_CLASSES] = {"1", "logn", "n", "nlogn", "n2"};
+
+static const char *cx_ops[] = {
+    "ih",      "it",       "rh",   "rt",    "size",   "dm",      "swap",
+    "reverse", "reverseK", "sort", "dedup", "ascend", "descend", "merge",
+    NULL,
+};
+
+static double cx_model(cx_class_t c, double n)
+{
+    switch (c) {
+    case CX_1:
+        return 1.0;
+    case CX_LOGN:
+        return log2(n);
+    case CX_N:
+        return n;
+    case CX_NLOGN:
+        return n * log2(n);
+    default:
+        return n * n;
+    }
+}
+
+static int64_t cx_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Cost of reading the clock, the least of several tries */
+static int64_t cx_clock_cost(void)
+{
+    int64_t least = INT64_MAX;
+    for (int i = 0; i < 16; i++) {
+        int64_t start = cx_now();
+        int64_t cost = cx_now() - start;
+        if (cost < least)
+            least = cost;
+    }
+    return least;
+}
+
+/* Fill q with n random strings, each repeated twice when dups is set */
+static bool cx_fill(struct list_head *q, int n, bool dups)
+{
+    char buf[MAX_RANDSTR_LEN];
+    for (int i = 0; i < n; i++) {
+        if (!dups || !(i & 1))
+            fill_rand_strings(&buf, 1);
+        if (!q_insert_tail(q, buf))
+            return false;
+    }
+    return true;
+}
+
+/* Operations that touch a bounded number of nodes per call */
+static bool cx_single(const char *op)
+{
+    return !strcmp(op, "ih") || !strcmp(op, "it") || !strcmp(op, "rh") ||
+           !strcmp(op, "rt");
+}
+
+/* Build the input of op in qchain: n elements, spread over several sorted
+ * queues for merge, with extra elements for every call that removes one.
+ * Returns false if the queues could not be built.
+ */
+static bool cx_build(struct list_head *qchain, const char *op, int n)
+{
+    bool merge = !strcmp(op, "merge");
+    bool dedup = !strcmp(op, "dedup");
+    int queues = merge ? COMPLEXITY_MERGE_QUEUES : 1;
+    int extra =
+        !strcmp(op, "rh") || !strcmp(op, "rt") ? COMPLEXITY_CALLS : 0;
+
+    for (int i = 0; i < queues; i++) {
+        queue_contex_t *ctx = malloc(sizeof(queue_contex_t));
+        if (!ctx)
+            return false;
+        ctx->q = q_new();
+        ctx->size = n / queues + extra;
+        ctx->id = i;
+        list_add_tail(&ctx->chain, qchain);
+        if (!ctx->q || !cx_fill(ctx->q, ctx->size, dedup))
+            return false;
+        /* q_delete_dup and q_merge expect sorted input */
+        if (merge || dedup)
+            q_sort(ctx->q, merge ? descend : false);
+    }
+    return true;
+}
+
+static void cx_release(struct list_head *qchain)
+{
+    queue_contex_t *ctx, *tmp;
+    list_for_each_entry_safe (ctx, tmp, qchain, chain) {
+        q_free(ctx->q);
+        free(ctx);
+    }
+    INIT_LIST_HEAD(qchain);
+}
+
+/* Apply op once to q, the first queue of qchain, which holds n elements
+ * unless op is constant time
+ */
+static bool cx_call(const char *op, struct list_head *qchain, int n)
+{
+    struct list_head *q = list_first_entry(qchain, queue_contex_t, chain)->q;
+    element_t *e = NULL;
+    bool ok = true;
+
+    if (!strcmp(op, "ih"))
+        ok = q_insert_head(q, "complexity");
+    else if (!strcmp(op, "it"))
+        ok = q_insert_tail(q, "complexity");
+    else if (!strcmp(op, "rh"))
+        ok = (e = q_remove_head(q, NULL, 0));
+    else if (!strcmp(op, "rt"))
+        ok = (e = q_remove_tail(q, NULL, 0));
+    else if (!strcmp(op, "size"))
+        ok = q_size(q) == n;
+    else if (!strcmp(op, "dm"))
+        ok = q_delete_mid(q);
+    else if (!strcmp(op, "swap"))
+        q_swap(q);
+    else if (!strcmp(op, "reverse"))
+        q_reverse(q);
+    else if (!strcmp(op, "reverseK"))
+        q_reverseK(q, 3);
+    else if (!strcmp(op, "sort"))
+        q_sort(q, descend);
+    else if (!strcmp(op, "dedup"))
+        ok = q_delete_dup(q);
+    else if (!strcmp(op, "ascend"))
+        q_ascend(q);
+    else if (!strcmp(op, "descend"))
+        q_descend(q);
+    else
+        ok = q_merge(qchain, descend) ==
+             n / COMPLEXITY_MERGE_QUEUES * COMPLEXITY_MERGE_QUEUES;
+    if (e)
+        q_release_element(e);
+    return ok;
+}
+
+/* Run one sample of op on an n-element input and return ns per call, or a
+ * negative value on failure.  Constant-time operations are timed over
+ * COMPLEXITY_CALLS calls on the same queue.  The others change their input,
+ * so each call gets a fresh one and is timed on its own, less the cost of
+ * reading the clock.  Input construction and teardown are untimed.
+ */
+static double cx_sample(const char *op, int n)
+{
+    bool single = cx_single(op);
+    int rounds = single ? 1 : COMPLEXITY_CALLS;
+    int calls = single ? COMPLEXITY_CALLS : 1;
+    int64_t clock = cx_clock_cost();
+    int64_t elapsed = 0;
+    bool ok = true;
+
+    LIST_HEAD(qchain);
+    for (int r = 0; ok && r < rounds; r++) {
+        if (!cx_build(&qchain, op, n)) {
+            report(1, "ERROR: Could not build a queue of %d elements", n);
+            cx_release(&qchain);
+            ok = false;
+            break;
+        }
+        if (!exception_setup(true)) {
+            /* Queue state is unknown after a fault or timeout, so leak it */
+            exception_cancel();
+            return -1;
+        }
+        /* Touch every node so that each call starts from a warm cache */
+        queue_contex_t *ctx;
+        list_for_each_entry (ctx, &qchain, chain)
+            q_size(ctx->q);
+        int64_t start = cx_now();
+        for (int i = 0; ok && i < calls; i++)
+            ok = cx_call(op, &qchain, n);
+        elapsed += cx_now() - start - clock;
+        exception_cancel();
+        if (!ok)
+            report(1, "ERROR: '%s' failed on a queue of %d elements", op, n);
+        cx_release(&qchain);
+    }
+    return ok ? (double) (elapsed > 0 ? elapsed : 1) / COMPLEXITY_CALLS : -1;
+}
+
+static int cx_cmp(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Least-squares slope of log y against log x */
+static double cx_slope(const double *x, const double *y, int cnt)
+{
+    double mx = 0, my = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < cnt; i++) {
+        mx += log(x[i]) / cnt;
+        my += log(y[i]) / cnt;
+    }
+    for (int i = 0; i < cnt; i++) {
+        sxx += (log(x[i]) - mx) * (log(x[i]) - mx);
+        sxy += (log(x[i]) - mx) * (log(y[i]) - my);
+    }
+    return sxy / sxx;
+}
+
+static bool do_complexity(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4) {
+        report(1, "%s needs 1-3 arguments", argv[0]);
+        return false;
+    }
+
+    const char *op = argv[1];
+    int i;
+    for (i = 0; cx_ops[i] && strcmp(cx_ops[i], op); i++)
+        ;
+    if (!cx_ops[i]) {
+        report(1, "Unknown operation '%s'", op);
+        return false;
+    }
+
+    int bound = CX_CLASSES;
+    if (argc >= 3) {
+        for (bound = 0; bound < CX_CLASSES && strcmp(cx_keys[bound], argv[2]);
+             bound++)
+            ;
+        if (bound == CX_CLASSES) {
+            report(1, "Invalid bound '%s' (use 1, logn, n, nlogn or n2)",
+                   argv[2]);
+            return false;
+        }
+    }
+
+    int max_log2 = COMPLEXITY_MAX_LOG2;
+    if (argc == 4) {
+        int max_n;
+        if (!get_int(argv[3], &max_n) ||
+            max_n < 1 << (COMPLEXITY_MIN_LOG2 + 2) || max_n > 1 << 26) {
+            report(1, "Invalid size '%s'", argv[3]);
+            return false;
+        }
+        for (max_log2 = COMPLEXITY_MIN_LOG2; 2 << max_log2 <= max_n;
+             max_log2++)
+            ;
+    }
+
+    /* Measure the queue code, not the harness's bookkeeping */
+    int saved_probability = fail_probability;
+    fail_probability = 0;
+    set_cautious_mode(false);
+
+    double sizes[64], times[64];
+    int cnt = 0;
+    bool ok = true;
+    for (int h = 2 * COMPLEXITY_MIN_LOG2; ok && h <= 2 * max_log2; h++) {
+        int n = (int) round(pow(2, h / 2.0));
+        double samples[COMPLEXITY_REPEAT];
+        for (int r = 0; ok && r < COMPLEXITY_REPEAT; r++)
+            ok = (samples[r] = cx_sample(op, n)) >= 0;
+        if (!ok)
+            break;
+        qsort(samples, COMPLEXITY_REPEAT, sizeof(double), cx_cmp);
+        sizes[cnt] = n;
+        times[cnt] = samples[0];
+        report(2, "  n = %8.0f  %14.1f ns", sizes[cnt], times[cnt]);
+        cnt++;
+        if (times[cnt - 1] > COMPLEXITY_BUDGET_NS &&
+            cnt >= COMPLEXITY_MIN_SIZES)
+            break;
+    }
+
+    fail_probability = saved_probability;
+    set_cautious_mode(cautious);
+    if (!ok)
+        return false;
+
+    /* Compare how fast the time grows, the slope of log t against log n,
+     * with how fast each class grows over the same sizes.  A constant cost
+     * per call would flatten the slope, so the cost of reading the clock
+     * has been taken off already.
+     */
+    double slope = cx_slope(sizes, times, cnt);
+    double expect[CX_CLASSES];
+    int best = 0;
+    for (int c = 0; c < CX_CLASSES; c++) {
+        double model[64];
+        for (i = 0; i < cnt; i++)
+            model[i] = cx_model(c, sizes[i]);
+        expect[c] = c == CX_1 ? 0 : cx_slope(sizes, model, cnt);
+        if (fabs(slope - expect[c]) < fabs(slope - expect[best]))
+            best = c;
+    }
+    report(1, "%s: slope %.2f, best fit %s (%s %.2f, %s %.2f)", op, slope,
+           cx_names[best], cx_names[best], expect[best],
+           cx_names[best < CX_N2 ? best + 1 : best - 1],
+           expect[best < CX_N2 ? best + 1 : best - 1]);
+
+    if (bound == CX_CLASSES)
+        return true;
+    report(1, "%s: fitted %s, expected %s", op, cx_names[best],
+           cx_names[bound]);
+    if (best > bound) {
+        report(1, "ERROR: '%s' grows as %s, expected at most %s", op,
+               cx_names[best], cx_names[bound]);
+        return false;
+    }
+    return true;
+}
+
+static void set_cautious(int oldval)
+{
+    set_cautious_mode(cautious);
+}
+
+static void set_seed(int oldval)
+{
+    randomseed((unsigned) seed);
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1038,6 +1664,10 @@ static void console_init()
     ADD_COMMAND(sort, "Sort queue in ascending/descening order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
+    ADD_COMMAND(stats,
+                "Show byte entropy, length distribution and duplicates of "
+                "queue values",
+                "");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
     ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
@@ -1052,14 +1682,45 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(mem, "Show memory usage of queue storage", "");
+    ADD_COMMAND(dudect, "Check whether op runs in constant time", "op");
+    ADD_COMMAND(complexity,
+                "Fit the growth of op's running time to O(1) .. O(n^2), "
+                "failing if it exceeds bound",
+                "op [1|logn|n|nlogn|n2] [max_n]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("guard", &guard_interval,
+              "Place 1 in N blocks against a guard page (0 = never)", NULL);
+    add_param("timeout", &time_limit,
+              "Time limit in seconds for queue operations (0 = none)", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("counter", &dudect_counter,
+              "Event compared in simulation mode when perf is available "
+              "(0 cycles, 1 instructions, 2 cache misses, 3 branch misses)",
+              NULL);
+    add_param("workers", &dudect_workers,
+              "Processes measuring in simulation mode (default 0 = one per "
+              "CPU)",
+              NULL);
+    add_param("seed", &seed,
+              "Seed for reproducible RAND strings and malloc failures "
+              "(0 = unpredictable)",
+              set_seed);
+    add_param("sequential", &dudect_sequential,
+              "Stop simulation tests as soon as the verdict is clear", NULL);
+    add_param("pool", &dudect_pool,
+              "Resize queues kept between simulation samples instead of "
+              "rebuilding them (default 0)",
+              NULL);
+    add_param("cautious", &cautious,
+              "Check that freed blocks are allocated (slow on large queues)",
+              set_cautious);
 }
 
 /* Signal handlers */
@@ -1107,7 +1768,7 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
+    set_cautious_mode(cautious);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1121,11 +1782,18 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-c CFILE][-r RFILE]"
+        "[-j JFILE][-s SEED]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-c CFILE   Compile commands from IFILE into CFILE and exit\n");
+    printf("\t-r RFILE   Replay commands from compiled RFILE\n");
+    printf("\t-j JFILE   Append JSON record per command and per run to JFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-s SEED    Make RAND strings and malloc failures reproducible\n");
     exit(0);
 }
 
@@ -1193,10 +1861,16 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char cbuf[BUFSIZE];
+    char *compile_name = NULL;
+    char rbuf[BUFSIZE];
+    char *replay_name = NULL;
+    char jbuf[BUFSIZE];
+    char *json_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:c:r:j:s:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1221,6 +1895,32 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'c':
+            strncpy(cbuf, optarg, BUFSIZE);
+            cbuf[BUFSIZE - 1] = '\0';
+            compile_name = cbuf;
+            break;
+        case 'r':
+            strncpy(rbuf, optarg, BUFSIZE);
+            rbuf[BUFSIZE - 1] = '\0';
+            replay_name = rbuf;
+            break;
+        case 'j':
+            strncpy(jbuf, optarg, BUFSIZE);
+            jbuf[BUFSIZE - 1] = '\0';
+            json_name = jbuf;
+            break;
+        case 's': {
+            char *endptr;
+            errno = 0;
+            seed = strtol(optarg, &endptr, 10);
+            if (errno != 0 || endptr == optarg) {
+                fprintf(stderr, "Invalid seed\n");
+                exit(EXIT_FAILURE);
+            }
+            randomseed((unsigned) seed);
+            break;
+        }
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1237,8 +1937,8 @@ int main(int argc, char *argv[])
     init_cmd();
     console_init();
 
-    /* Initialize linenoise only when infile_name not exist */
-    if (!infile_name) {
+    /* Initialize linenoise only when no input file is given */
+    if (!infile_name && !replay_name) {
         /* Trigger call back function(auto completion) */
         line_set_completion_callback(completion);
 
@@ -1251,11 +1951,24 @@ int main(int argc, char *argv[])
         set_echo(true);
     if (logfile_name)
         set_logfile(logfile_name);
+    if (json_name && !set_jsonfile(json_name)) {
+        fprintf(stderr, "Could not open JSON output file '%s'\n", json_name);
+        exit(EXIT_FAILURE);
+    }
+    set_json_helper(json_state);
 
     add_quit_helper(q_quit);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (compile_name) {
+        if (!infile_name)
+            report(1, "ERROR: No input file to compile");
+        ok = infile_name && compile_trace(infile_name, compile_name);
+    } else if (replay_name) {
+        ok = replay_trace(replay_name);
+    } else {
+        ok = ok && run_console(infile_name);
+    }
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
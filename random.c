@@ -30,6 +30,10 @@
 
 #include "random.h"
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
 #if defined(__linux__) || defined(__GNU__)
 /* We would need to include <linux/random.h>, but not every target has access
  * to the linux headers. We only need RNDGETENTCNT, so we instead inline it.
@@ -274,7 +278,7 @@ static int randombytes_bsd_randombytes(void *buf, size_t n)
 }
 #endif
 
-int randombytes(uint8_t *buf, size_t n)
+static int randombytes_os(uint8_t *buf, size_t n)
 {
 #if defined(__linux__) || defined(__GNU__)
 #if defined(USE_GLIBC)
@@ -293,3 +297,276 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/* Userspace generator on top of randombytes_os(): ChaCha20 keyed from the
+ * OS, producing CHACHA_BLOCKS blocks per refill.  The first CHACHA_KEY bytes
+ * of every refill rekey the cipher and are never handed out, so state
+ * captured later does not reveal output already served.  The key is also
+ * replaced by fresh OS entropy every CHACHA_RESEED bytes and in the child
+ * after fork(), so that dudect workers do not share a stream.
+ */
+#define CHACHA_BLOCK 64
+#define CHACHA_BLOCKS 16
+#define CHACHA_KEY 32
+#define CHACHA_NONCE 8
+#define CHACHA_RESEED (1 << 20)
+
+static struct {
+    uint32_t input[16];
+    uint8_t buf[CHACHA_BLOCK * CHACHA_BLOCKS];
+    size_t avail;
+    size_t since_seed;
+    bool seeded;
+    uint64_t bits;
+    int nbits;
+} rng;
+
+static uint32_t load32(const uint8_t *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+           (uint32_t) p[3] << 24;
+}
+
+static void store32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+#define ROTL32(v, c) (((v) << (c)) | ((v) >> (32 - (c))))
+#define QUARTERROUND(a, b, c, d) \
+    do {                         \
+        a += b;                  \
+        d = ROTL32(d ^ a, 16);   \
+        c += d;                  \
+        b = ROTL32(b ^ c, 12);   \
+        a += b;                  \
+        d = ROTL32(d ^ a, 8);    \
+        c += d;                  \
+        b = ROTL32(b ^ c, 7);    \
+    } while (0)
+
+static void chacha20_block(const uint32_t input[16], uint8_t out[64])
+{
+    uint32_t x[16];
+    memcpy(x, input, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+        store32(out + 4 * i, x[i] + input[i]);
+}
+
+static void chacha_rekey(const uint8_t *key, const uint8_t *nonce)
+{
+    /* "expand 32-byte k" */
+    rng.input[0] = 0x61707865;
+    rng.input[1] = 0x3320646e;
+    rng.input[2] = 0x79622d32;
+    rng.input[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++)
+        rng.input[4 + i] = load32(key + 4 * i);
+    rng.input[12] = 0;
+    rng.input[13] = 0;
+    if (nonce) {
+        rng.input[14] = load32(nonce);
+        rng.input[15] = load32(nonce + 4);
+    }
+}
+
+static void chacha_refill(void)
+{
+    for (int i = 0; i < CHACHA_BLOCKS; i++) {
+        chacha20_block(rng.input, rng.buf + i * CHACHA_BLOCK);
+        if (++rng.input[12] == 0)
+            rng.input[13]++;
+    }
+    chacha_rekey(rng.buf, NULL);
+    memset(rng.buf, 0, CHACHA_KEY);
+    rng.avail = sizeof(rng.buf) - CHACHA_KEY;
+}
+
+/* Deterministic mode, selected with randomseed(): xoshiro256** replaces the
+ * cipher, so that a seed reproduces every byte handed out.
+ */
+static bool xoshiro_mode = false;
+static uint64_t xoshiro[4];
+
+static inline uint64_t rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* xoshiro256** by David Blackman and Sebastiano Vigna, see:
+ * <https://prng.di.unimi.it/xoshiro256starstar.c>
+ */
+static uint64_t xoshiro_next(void)
+{
+    uint64_t result = rotl64(xoshiro[1] * 5, 7) * 9;
+    uint64_t t = xoshiro[1] << 17;
+    xoshiro[2] ^= xoshiro[0];
+    xoshiro[3] ^= xoshiro[1];
+    xoshiro[1] ^= xoshiro[2];
+    xoshiro[0] ^= xoshiro[3];
+    xoshiro[2] ^= t;
+    xoshiro[3] = rotl64(xoshiro[3], 45);
+    return result;
+}
+
+/* Advance by 2^128 steps, as if xoshiro_next() had been called that often */
+static void xoshiro_jump(void)
+{
+    static const uint64_t jump[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                    0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+    uint64_t s[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] & (uint64_t) 1 << b) {
+                for (int k = 0; k < 4; k++)
+                    s[k] ^= xoshiro[k];
+            }
+            xoshiro_next();
+        }
+    }
+    memcpy(xoshiro, s, sizeof(xoshiro));
+}
+
+static void rng_forget(void)
+{
+    rng.seeded = false;
+    rng.avail = 0;
+    rng.nbits = 0;
+}
+
+/* A child keeps the seeded stream where the parent left it, and the parent
+ * jumps past it, so that every child of a seeded run gets its own
+ * reproducible stream.  Without a seed, the child simply rekeys.
+ */
+static void rng_fork_parent(void)
+{
+    if (xoshiro_mode)
+        xoshiro_jump();
+}
+
+static void rng_fork_child(void)
+{
+    if (!xoshiro_mode)
+        rng_forget();
+    rng.nbits = 0;
+}
+
+static void rng_register(void)
+{
+    static bool registered = false;
+    if (!registered) {
+        pthread_atfork(NULL, rng_fork_parent, rng_fork_child);
+        registered = true;
+    }
+}
+
+void randomseed(uint64_t seed)
+{
+    rng_register();
+    rng_forget();
+    xoshiro_mode = seed != 0;
+    if (!xoshiro_mode)
+        return;
+    /* Expand the seed with splitmix64, which never yields an all-zero state */
+    for (int i = 0; i < 4; i++) {
+        seed += 0x9e3779b97f4a7c15;
+        xoshiro[i] = random_shuffle(seed);
+    }
+}
+
+static int rng_seed(void)
+{
+    uint8_t seed[CHACHA_KEY + CHACHA_NONCE];
+
+    rng_register();
+    if (randombytes_os(seed, sizeof(seed)) != 0)
+        return -1;
+    chacha_rekey(seed, seed + CHACHA_KEY);
+    memset(seed, 0, sizeof(seed));
+    rng.avail = 0;
+    rng.since_seed = 0;
+    rng.seeded = true;
+    return 0;
+}
+
+int randombytes(uint8_t *buf, size_t n)
+{
+    if (xoshiro_mode) {
+        for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t)) {
+            uint64_t x = xoshiro_next();
+            memcpy(buf, &x, sizeof(x));
+            buf += sizeof(x);
+        }
+        if (n) {
+            uint64_t x = xoshiro_next();
+            memcpy(buf, &x, n);
+        }
+        return 0;
+    }
+
+    while (n > 0) {
+        if (!rng.seeded || rng.since_seed >= CHACHA_RESEED) {
+            if (rng_seed() != 0)
+                return -1;
+        }
+        if (!rng.avail)
+            chacha_refill();
+
+        size_t chunk = n < rng.avail ? n : rng.avail;
+        uint8_t *src = rng.buf + sizeof(rng.buf) - rng.avail;
+        memcpy(buf, src, chunk);
+        memset(src, 0, chunk);
+        rng.avail -= chunk;
+        rng.since_seed += chunk;
+        buf += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+uint8_t randombit(void)
+{
+    if (!rng.nbits) {
+        randombytes((uint8_t *) &rng.bits, sizeof(rng.bits));
+        rng.nbits = 64;
+    }
+    uint8_t ret = rng.bits & 1;
+    rng.bits >>= 1;
+    rng.nbits--;
+    return ret;
+}
+
+/* Uniform in [0, bound), by Lemire's multiply-shift with rejection of the
+ * few products that would bias the result.
+ */
+uint32_t randombounded(uint32_t bound)
+{
+    uint32_t x;
+    if (!bound)
+        return 0;
+    randombytes((uint8_t *) &x, sizeof(x));
+    uint64_t m = (uint64_t) x * bound;
+    uint32_t low = (uint32_t) m;
+    if (low < bound) {
+        uint32_t threshold = -bound % bound;
+        while (low < threshold) {
+            randombytes((uint8_t *) &x, sizeof(x));
+            m = (uint64_t) x * bound;
+            low = (uint32_t) m;
+        }
+    }
+    return m >> 32;
+}
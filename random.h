@@ -4,14 +4,21 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Fill buf from a ChaCha20 generator keyed by the OS entropy source.
+ * Return 0 on success, or -1 if the OS could not provide a seed.
+ */
 extern int randombytes(uint8_t *buf, size_t len);
 
-static inline uint8_t randombit(void)
-{
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return ret & 1;
-}
+/* Random bit, taken from a word of generator output 64 bits at a time */
+extern uint8_t randombit(void);
+
+/* Uniform random integer in [0, bound), without modulo bias */
+extern uint32_t randombounded(uint32_t bound);
+
+/* Make every function above replay a fast xoshiro256** stream derived from
+ * seed, for reproducible runs.  A seed of 0 returns to OS-keyed output.
+ */
+extern void randomseed(uint64_t seed);
 
 #if INTPTR_MAX == INT64_MAX
 #define M_INTPTR_SHIFT (3)
@@ -17,6 +17,11 @@
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
+static FILE *jsonfile = NULL;
+/* Quoted trace name leading every record, so that records appended to one
+ * file by concurrent runs can be told apart
+ */
+static char json_trace[MAX_CHAR] = "";
 
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
@@ -51,6 +56,66 @@ bool set_logfile(const char *file_name)
     return logfile != NULL;
 }
 
+bool set_jsonfile(const char *file_name)
+{
+    jsonfile = fopen(file_name, "a");
+    return jsonfile != NULL;
+}
+
+bool json_enabled()
+{
+    return jsonfile != NULL;
+}
+
+void set_json_trace(const char *name)
+{
+    json_string(json_trace, sizeof(json_trace), name);
+}
+
+void report_json(char *fmt, ...)
+{
+    if (!jsonfile)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    fputc('{', jsonfile);
+    if (json_trace[0])
+        fprintf(jsonfile, "\"trace\": %s, ", json_trace);
+    vfprintf(jsonfile, fmt, ap);
+    fputs("}\n", jsonfile);
+    fflush(jsonfile);
+    va_end(ap);
+}
+
+size_t json_string(char *buf, size_t size, const char *s)
+{
+    size_t n = 0;
+    if (size < 3)
+        return 0;
+
+    /* Leave room for closing quote and null terminator */
+    buf[n++] = '"';
+    for (; *s && n + 2 < size; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            if (n + 3 >= size)
+                break;
+            buf[n++] = '\\';
+            buf[n++] = c;
+        } else if (c < 0x20) {
+            if (n + 8 >= size)
+                break;
+            n += snprintf(buf + n, size - n, "\\u%04x", c);
+        } else {
+            buf[n++] = c;
+        }
+    }
+    buf[n++] = '"';
+    buf[n] = '\0';
+    return n;
+}
+
 void report_event(message_t msg, char *fmt, ...)
 {
     va_list ap;
@@ -298,6 +363,14 @@ void free_string(char *s)
     free_block((void *) s, strlen(s) + 1);
 }
 
+void mem_usage(size_t *current, size_t *peak, size_t *last_peak)
+{
+    *current = current_bytes;
+    *peak = peak_bytes;
+    *last_peak = last_peak_bytes;
+    last_peak_bytes = current_bytes;
+}
+
 /* Initialization of timers */
 void init_time(double *timep)
 {
@@ -14,6 +14,21 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL, N_MSG } message_t;
 
 bool set_logfile(const char *file_name);
 
+/* Structured output: records are appended to file, one JSON object per line */
+bool set_jsonfile(const char *file_name);
+bool json_enabled();
+
+/* Name the trace that every following record comes from */
+void set_json_trace(const char *name);
+
+/* Write one record.  fmt gives the members, without the enclosing braces */
+void report_json(char *fmt, ...);
+
+/* Append s to buf as a quoted JSON string, truncating to fit in size bytes.
+ * Return number of characters written, not counting the null terminator
+ */
+size_t json_string(char *buf, size_t size, const char *s);
+
 extern int verblevel;
 void set_verblevel(int level);
 
@@ -44,6 +59,11 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/* Report bytes allocated through the *_or_fail functions: current, overall
+ * peak, and peak since the previous call (which resets it)
+ */
+void mem_usage(size_t *current, size_t *peak, size_t *last_peak);
+
 /* Time counted as fp number in seconds */
 void init_time(double *timep);
 
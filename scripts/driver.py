@@ -4,6 +4,11 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import json
+import os
+from concurrent.futures import ThreadPoolExecutor
+import statistics
+import time
 
 
 
@@ -17,6 +22,8 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    jsonFile = ""
+    jobs = 1
 
     traceDict = {
         1: "trace-01-ops",
@@ -60,6 +67,12 @@ class Tracer:
 
     maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
 
+    # Traces timed by benchmark mode
+    perfTraces = [14, 15, 16]
+
+    # Traces sensitive to machine load, never run alongside others
+    serialTraces = [14, 15, 16, 17]
+
     RED = '\033[91m'
     GREEN = '\033[92m'
     WHITE = '\033[0m'
@@ -69,33 +82,121 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 jsonFile="",
+                 jobs=1):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.jsonFile = jsonFile
+        self.jobs = jobs
 
     def printInColor(self, text, color):
         if self.colored == False:
             color = self.WHITE
         print(color, text, self.WHITE, sep = '')
 
-    def runTrace(self, tid):
+    # Run trace, returning success, captured output (when capture is set,
+    # otherwise output goes straight to the terminal) and wall time
+    def runTrace(self, tid, capture=False):
         if not tid in self.traceDict:
             self.printInColor("ERROR: No trace with id %d" % tid, self.RED)
-            return False
+            return False, "", 0
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
         vname = "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
+        if self.jsonFile:
+            clist += ["-j", self.jsonFile]
+
+        start = time.monotonic()
+        try:
+            if capture:
+                proc = subprocess.run(clist, stdout=subprocess.PIPE,
+                                      stderr=subprocess.STDOUT)
+                retcode = proc.returncode
+                output = proc.stdout.decode(errors="replace")
+            else:
+                retcode = subprocess.call(clist)
+                output = ""
+        except Exception as e:
+            return False, "Call of '%s' failed: %s\n" % (" ".join(clist), e), 0
+        return retcode == 0, output, time.monotonic() - start
 
+    # Run trace once, returning success, wall time in seconds, and peak RSS
+    # in kilobytes of that qtest process alone
+    def benchTrace(self, tid):
+        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
+        clist = [self.qtest, "-v", "0", "-f", fname]
+        start = time.monotonic()
         try:
-            retcode = subprocess.call(clist)
+            proc = subprocess.Popen(clist)
         except Exception as e:
             self.printInColor("Call of '%s' failed: %s" % (" ".join(clist), e), self.RED)
-            return False
-        return retcode == 0
+            return False, 0, 0
+        _, status, usage = os.wait4(proc.pid, 0)
+        elapsed = time.monotonic() - start
+        return os.waitstatus_to_exitcode(status) == 0, elapsed, usage.ru_maxrss
+
+    def bench(self, runs, baselineFile="", updateBaseline=False, threshold=10):
+        results = {}
+        failed = False
+        print("---\tTrace\t\tTime median (stdev)\tRSS median (stdev)")
+        for t in self.perfTraces:
+            tname = self.traceDict[t]
+            times = []
+            rss = []
+            for _ in range(runs):
+                ok, elapsed, maxrss = self.benchTrace(t)
+                if not ok:
+                    self.printInColor("---\t%s\tfailed" % tname, self.RED)
+                    failed = True
+                    break
+                times.append(elapsed)
+                rss.append(maxrss)
+            if len(times) < runs:
+                continue
+            results[tname] = {
+                "time_median": statistics.median(times),
+                "time_stdev": statistics.pstdev(times),
+                "rss_median": statistics.median(rss),
+                "rss_stdev": statistics.pstdev(rss),
+            }
+            r = results[tname]
+            print("---\t%s\t%.3f s (%.3f)\t\t%d KB (%d)" %
+                  (tname, r["time_median"], r["time_stdev"],
+                   r["rss_median"], r["rss_stdev"]))
+
+        if baselineFile and updateBaseline:
+            with open(baselineFile, "w") as f:
+                json.dump(results, f, indent=4, sort_keys=True)
+                f.write("\n")
+            print("Baseline saved to %s" % baselineFile)
+        elif baselineFile:
+            try:
+                with open(baselineFile) as f:
+                    baseline = json.load(f)
+            except Exception as e:
+                self.printInColor("Cannot read baseline '%s': %s" % (baselineFile, e), self.RED)
+                sys.exit(1)
+            limit = 1 + threshold / 100.0
+            for tname, r in results.items():
+                if not tname in baseline:
+                    continue
+                b = baseline[tname]
+                for key, unit in [("time_median", "s"), ("rss_median", "KB")]:
+                    ratio = r[key] / b[key] if b[key] else 1
+                    text = "---\t%s\t%s %.3f%s vs baseline %.3f%s (%+.1f%%)" % (
+                        tname, key, r[key], unit, b[key], unit, (ratio - 1) * 100)
+                    if ratio > limit:
+                        self.printInColor(text, self.RED)
+                        failed = True
+                    else:
+                        self.printInColor(text, self.GREEN)
+        if failed:
+            sys.exit(1)
 
     def run(self, tid=0):
         scoreDict = {k: 0 for k in self.traceDict.keys()}
@@ -113,13 +214,36 @@ class Tracer:
             self.command = ['valgrind', self.qtest]
         else:
             self.command = [self.qtest]
+        if self.jsonFile:
+            # qtest appends its own records, so start from an empty file
+            open(self.jsonFile, "w").close()
+        # Run independent traces concurrently first, keeping their output
+        # until it is reported in trace order below
+        done = {}
+        if self.jobs > 1:
+            parallel = [t for t in tidList if not t in self.serialTraces]
+            with ThreadPoolExecutor(max_workers=self.jobs) as pool:
+                futures = {t: pool.submit(self.runTrace, t, True)
+                           for t in parallel}
+            done = {t: f.result() for t, f in futures.items()}
         for t in tidList:
             tname = self.traceDict[t]
             if self.verbLevel > 0:
-                print("+++ TESTING trace %s:" % tname)
-            ok = self.runTrace(t)
+                print("+++ TESTING trace %s:" % tname, flush=True)
+            if t in done:
+                ok, output, elapsed = done[t]
+                print(output, end="", flush=True)
+            else:
+                ok, output, elapsed = self.runTrace(t)
+                if output:
+                    self.printInColor(output, self.RED)
             maxval = self.maxScores[t]
             tval = maxval if ok else 0
+            if self.jsonFile:
+                with open(self.jsonFile, "a") as f:
+                    f.write(json.dumps({"driver": tname, "score": tval,
+                                        "max": maxval,
+                                        "elapsed_ns": int(elapsed * 1e9)}) + "\n")
             if tval < maxval:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.RED)
             else:
@@ -146,12 +270,18 @@ class Tracer:
             sys.exit(1)
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c] [-j FILE]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
     print("  -c Enable colored text")
+    print("  -j FILE   Write JSON records per command and per trace to FILE")
+    print("  --jobs N            Run up to N traces at once (default: 1)")
+    print("  --bench N           Time the perf traces N times each")
+    print("  --baseline FILE     Compare benchmark with baseline in FILE")
+    print("  --update-baseline   Save benchmark as new baseline in FILE instead")
+    print("  --threshold PCT     Percent slowdown or growth that fails (default: 10)")
     sys.exit(0)
 
 
@@ -163,8 +293,16 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    jsonFile = ""
+    benchRuns = 0
+    baselineFile = ""
+    updateBaseline = False
+    threshold = 10
+    jobs = 1
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:cj:', [
+        'valgrind', 'bench=', 'baseline=', 'update-baseline', 'threshold=',
+        'jobs='])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,6 +319,18 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-j':
+            jsonFile = val
+        elif opt == '--bench':
+            benchRuns = int(val)
+        elif opt == '--baseline':
+            baselineFile = val
+        elif opt == '--update-baseline':
+            updateBaseline = True
+        elif opt == '--threshold':
+            threshold = float(val)
+        elif opt == '--jobs':
+            jobs = int(val)
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -190,8 +340,13 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
-    t.run(tid)
+               colored=colored,
+               jsonFile=jsonFile,
+               jobs=jobs)
+    if benchRuns > 0:
+        t.bench(benchRuns, baselineFile, updateBaseline, threshold)
+    else:
+        t.run(tid)
 
 
 if __name__ == "__main__":
@@ -0,0 +1,324 @@
+#!/usr/bin/env python3
+
+# Generate parameterized qtest workloads for characterizing queue scaling.
+#
+# The trace fills a queue with SIZE elements and then issues OPS operations
+# drawn from a weighted mix.  Values are picked from a vocabulary of DISTINCT
+# strings with Zipfian popularity, so that sort, dedup and merge see realistic
+# key skew.  Runs of identical inserts are folded into 'ih str n' lines, which
+# keeps traces with 10^8 elements to a manageable size.
+
+import argparse
+import math
+import random
+import sys
+
+OPS = ["ih", "it", "rh", "rt", "sort", "dedup", "merge", "reverse", "swap",
+       "dm", "size"]
+INSERTS = ("ih", "it")
+REMOVES = ("rh", "rt", "dm")
+LETTERS = "abcdefghijklmnopqrstuvwxyz"
+MAX_LEN = 1024
+MASK64 = (1 << 64) - 1
+
+
+def splitmix64(x):
+    x = (x + 0x9e3779b97f4a7c15) & MASK64
+    x = ((x ^ (x >> 30)) * 0xbf58476d1ce4e5b9) & MASK64
+    x = ((x ^ (x >> 27)) * 0x94d049bb133111eb) & MASK64
+    return x ^ (x >> 31)
+
+
+def parseSize(text):
+    # Accept plain integers as well as 1e6, 10^6, 250k and 2M
+    t = text.strip().lower()
+    scale = {"k": 10**3, "m": 10**6, "g": 10**9}
+    try:
+        if "^" in t:
+            base, exp = t.split("^")
+            return int(base) ** int(exp)
+        if t and t[-1] in scale:
+            return int(float(t[:-1]) * scale[t[-1]])
+        return int(float(t))
+    except ValueError:
+        raise argparse.ArgumentTypeError("invalid size '%s'" % text)
+
+
+def parseMix(text):
+    mix = {}
+    for item in text.split(","):
+        if not item:
+            continue
+        name, _, weight = item.partition("=")
+        if name not in OPS:
+            raise argparse.ArgumentTypeError("unknown operation '%s'" % name)
+        try:
+            mix[name] = float(weight) if weight else 1.0
+        except ValueError:
+            raise argparse.ArgumentTypeError("invalid weight '%s'" % weight)
+        if mix[name] < 0:
+            raise argparse.ArgumentTypeError("negative weight for '%s'" % name)
+    if sum(mix.values()) <= 0:
+        raise argparse.ArgumentTypeError("operation mix is empty")
+    return mix
+
+
+def parseLength(text):
+    kind, _, rest = text.partition(":")
+    try:
+        args = [int(a) for a in rest.split(":")] if rest else []
+    except ValueError:
+        raise argparse.ArgumentTypeError("invalid length '%s'" % text)
+    if kind == "fixed" and len(args) == 1 and args[0] >= 1:
+        return (kind, args)
+    if kind == "uniform" and len(args) == 2 and 1 <= args[0] <= args[1]:
+        return (kind, args)
+    if kind == "geometric" and len(args) == 1 and args[0] >= 1:
+        return (kind, args)
+    raise argparse.ArgumentTypeError(
+        "length must be fixed:N, uniform:MIN:MAX or geometric:MEAN")
+
+
+class Zipf:
+    """Rejection-inversion sampler (Hormann and Derflinger) over ranks
+    1..n with P(k) proportional to k^-s.  Constant time and space per draw,
+    so vocabularies of 10^8 values need no cumulative table.
+    """
+
+    def __init__(self, rng, n, s):
+        self.rng = rng
+        self.n = n
+        self.s = s
+        if s > 0:
+            self.hx1 = self.hIntegral(1.5) - 1.0
+            self.hn = self.hIntegral(n + 0.5)
+            self.c = 2.0 - self.hIntegralInverse(self.hIntegral(2.5) -
+                                                 self.h(2.0))
+
+    @staticmethod
+    def expm1x(x):
+        return math.expm1(x) / x if abs(x) > 1e-8 else 1.0 + x / 2.0
+
+    @staticmethod
+    def log1px(x):
+        return math.log1p(x) / x if abs(x) > 1e-8 else 1.0 - x / 2.0
+
+    def h(self, x):
+        return math.exp(-self.s * math.log(x))
+
+    def hIntegral(self, x):
+        lx = math.log(x)
+        return self.expm1x((1.0 - self.s) * lx) * lx
+
+    def hIntegralInverse(self, x):
+        t = max(x * (1.0 - self.s), -1.0)
+        return math.exp(self.log1px(t) * x)
+
+    def draw(self):
+        if self.s <= 0:
+            return self.rng.randrange(self.n) + 1
+        while True:
+            u = self.hn + self.rng.random() * (self.hx1 - self.hn)
+            x = self.hIntegralInverse(u)
+            k = min(max(int(x + 0.5), 1), self.n)
+            if k - x <= self.c or u >= self.hIntegral(k + 0.5) - self.h(k):
+                return k
+
+
+class Generator:
+
+    def __init__(self, args, out):
+        self.args = args
+        self.out = out
+        self.rng = random.Random(args.seed)
+        self.zipf = Zipf(self.rng, args.distinct, args.zipf)
+        # Base 26 digits needed for the largest rank
+        self.width = 1
+        while 26 ** self.width <= args.distinct:
+            self.width += 1
+        self.salt = splitmix64(args.seed)
+        self.size = 0
+        self.last = None
+        self.pending = None
+        self.names = list(args.mix)
+        self.weights = [args.mix[n] for n in self.names]
+
+    def valueLength(self, rank):
+        kind, params = self.args.length
+        u = splitmix64(rank ^ self.salt) / float(MASK64 + 1)
+        if kind == "fixed":
+            n = params[0]
+        elif kind == "uniform":
+            n = params[0] + int(u * (params[1] - params[0] + 1))
+        else:
+            p = 1.0 / params[0]
+            n = 1 if p >= 1 else 1 + int(math.log1p(-u) / math.log1p(-p))
+        return min(n, MAX_LEN)
+
+    def value(self, rank):
+        # Distinct ranks map to distinct strings: the rank in base 26, padded
+        # to a fixed width, is the suffix, the prefix is hash-derived padding
+        # up to the drawn length
+        digits = ""
+        r = rank
+        for _ in range(self.width):
+            digits = LETTERS[r % 26] + digits
+            r //= 26
+        pad = self.valueLength(rank) - len(digits)
+        h = splitmix64(rank + self.salt)
+        prefix = []
+        for _ in range(max(pad, 0)):
+            prefix.append(LETTERS[h % 26])
+            h //= 26
+            if h < 26:
+                h = splitmix64(h + rank)
+        return "".join(prefix) + digits
+
+    def nextValue(self):
+        if self.args.rand:
+            return "RAND"
+        if self.last is not None and self.rng.random() < self.args.dup:
+            return self.last
+        self.last = self.value(self.zipf.draw())
+        return self.last
+
+    def emit(self, line):
+        self.out.write(line + "\n")
+
+    def flush(self):
+        if self.pending:
+            cmd, value, count = self.pending
+            self.emit("%s %s %d" % (cmd, value, count)
+                      if count > 1 else "%s %s" % (cmd, value))
+            self.pending = None
+
+    def insert(self, cmd, count=1):
+        if self.args.rand and count > 1:
+            self.flush()
+            for start in range(0, count, self.args.chunk):
+                n = min(self.args.chunk, count - start)
+                self.emit("%s RAND %d" % (cmd, n))
+            self.size += count
+            return
+        for _ in range(count):
+            value = self.nextValue()
+            p = self.pending
+            if p and p[0] == cmd and p[1] == value and p[2] < self.args.chunk:
+                self.pending = (cmd, value, p[2] + 1)
+            else:
+                self.flush()
+                self.pending = (cmd, value, 1)
+            self.size += 1
+
+    def command(self, line):
+        self.flush()
+        self.emit(line)
+
+    def merge(self):
+        # q_merge needs every queue in the chain sorted
+        self.command("sort")
+        self.command("new")
+        self.insert("it", self.args.merge_size)
+        self.command("sort")
+        self.command("merge")
+
+    def operation(self):
+        name = self.rng.choices(self.names, self.weights)[0]
+        if name in INSERTS:
+            self.insert(name)
+        elif name in REMOVES:
+            if self.size == 0:
+                return False
+            self.command(name)
+            self.size -= 1
+        elif name == "merge":
+            self.merge()
+        else:
+            # dedup leaves self.size as an upper bound; a later removal from
+            # an emptied queue is absorbed by the 'fail' allowance
+            self.command(name)
+        return True
+
+    def run(self):
+        a = self.args
+        self.emit("# Generated by %s" % " ".join(sys.argv))
+        self.emit("option fail %d" % (a.ops + 1))
+        self.emit("option malloc 0")
+        self.emit("option timeout %d" % a.timeout)
+        if not a.cautious:
+            self.emit("option cautious 0")
+        if not a.echo:
+            self.emit("option echo 0")
+        self.command("new")
+        self.insert(a.fill, a.size)
+        done = 0
+        while done < a.ops:
+            if self.operation():
+                done += 1
+        self.command("free")
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        description="Generate a parameterized qtest performance trace")
+    parser.add_argument("-n", "--size", type=parseSize, default=10**4,
+                        help="elements inserted before the mix (1e3 .. 1e8)")
+    parser.add_argument("-m", "--ops", type=parseSize, default=None,
+                        help="operations drawn from the mix (default: size)")
+    parser.add_argument("--mix", type=parseMix,
+                        default=parseMix("ih=4,it=4,rh=1,rt=1"),
+                        help="weighted operations, e.g. ih=4,rt=2,sort=0.01 "
+                        "(known: %s)" % ",".join(OPS))
+    parser.add_argument("--fill", choices=INSERTS, default="it",
+                        help="insertion used to build the initial queue")
+    parser.add_argument("-l", "--length", type=parseLength,
+                        default=parseLength("uniform:5:10"),
+                        help="value length: fixed:N, uniform:MIN:MAX or "
+                        "geometric:MEAN")
+    parser.add_argument("-d", "--distinct", type=parseSize, default=None,
+                        help="vocabulary size (default: size)")
+    parser.add_argument("-z", "--zipf", type=float, default=0.0,
+                        help="Zipf exponent of value popularity (0: uniform)")
+    parser.add_argument("--dup", type=float, default=0.0,
+                        help="probability an insert repeats the previous value")
+    parser.add_argument("--merge-size", type=parseSize, default=None,
+                        help="elements in the queue merged by each 'merge' "
+                        "(default: size / 10)")
+    parser.add_argument("--rand", action="store_true",
+                        help="insert RAND strings generated by qtest instead")
+    parser.add_argument("--chunk", type=parseSize, default=10**6,
+                        help="longest repeated insert folded into one line")
+    parser.add_argument("--timeout", type=int, default=0,
+                        help="per-operation time limit in seconds (0: none)")
+    parser.add_argument("--cautious", action="store_true",
+                        help="keep the harness's O(n) check on every free")
+    parser.add_argument("--echo", action="store_true",
+                        help="keep command echo on")
+    parser.add_argument("-s", "--seed", type=int, default=1)
+    parser.add_argument("-o", "--output", default="-",
+                        help="trace file to write (default: stdout)")
+    args = parser.parse_args(argv)
+
+    if args.ops is None:
+        args.ops = args.size
+    if args.distinct is None:
+        args.distinct = max(args.size, 1)
+    if args.merge_size is None:
+        args.merge_size = max(args.size // 10, 1)
+    if args.distinct < 1 or args.chunk < 1:
+        parser.error("--distinct and --chunk must be positive")
+    if not 0.0 <= args.dup <= 1.0:
+        parser.error("--dup must be within [0, 1]")
+    if args.zipf < 0:
+        parser.error("--zipf must not be negative")
+
+    out = sys.stdout if args.output == "-" else open(args.output, "w")
+    try:
+        Generator(args, out).run()
+    finally:
+        if out is not sys.stdout:
+            out.close()
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
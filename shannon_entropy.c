@@ -32,3 +32,28 @@ double shannon_entropy(const uint8_t *s)
     entropy_sum /= LOG2_ARG_SHIFT;
     return entropy_sum * 100.0 / entropy_max;
 }
+
+/* Entropy of count bytes whose values have been tallied into bucket, on the
+ * same 0..100% scale as shannon_entropy().  The probabilities are scaled
+ * before dividing, so that large counts keep their precision.
+ */
+double shannon_entropy_buckets(const uint64_t *bucket, uint64_t count)
+{
+    assert(bucket);
+    if (!count)
+        return 0;
+
+    uint64_t entropy_sum = 0;
+    const uint64_t entropy_max = 8 * LOG2_RET_SHIFT;
+
+    for (uint32_t i = 0; i < BUCKET_SIZE; i++) {
+        if (bucket[i]) {
+            uint64_t p =
+                (uint64_t) ((double) bucket[i] * LOG2_ARG_SHIFT / count);
+            entropy_sum += -p * log2_lshift16(p);
+        }
+    }
+
+    entropy_sum /= LOG2_ARG_SHIFT;
+    return entropy_sum * 100.0 / entropy_max;
+}